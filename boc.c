@@ -8,15 +8,29 @@ int boc_main(boc *b)
 
 	boc_add_src("vendor/glad.c");
     boc_add_src("src/freenote.c");
+    boc_add_src("src/note.c");
     boc_add_src("src/clib.c");
 
 	boc_add_lib_dir("lib");
 
 	boc_add_lib("glfw3");
 	boc_add_lib("m");
+	boc_add_lib("pthread");
 	boc_add_lib("GL");
 
 	boc_flag_debug_symbols();
 	//boc_flag_sanitise_addresses();
+
+	// Headless tool for batch work on note files, no GLFW/GL
+    boc_add_exec("fn-tool");
+
+    boc_add_src("src/fntool.c");
+    boc_add_src("src/note.c");
+    boc_add_src("src/clib.c");
+
+	boc_add_lib("m");
+	boc_add_lib("pthread");
+
+	boc_flag_debug_symbols();
     return 0;
 }
@@ -1,6 +1,8 @@
 #version 330 core
 
-layout (location = 0) in vec2 a_point;
+// Points come straight from a page's x and y columns
+layout (location = 0) in float a_x;
+layout (location = 1) in float a_y;
 
 // (x, y) - framebuffer_centre_point is vector from framebuffer centre to point in point space
 // (x, -y) flips the y axis for NDC axes
@@ -10,9 +12,11 @@ layout (location = 0) in vec2 a_point;
 uniform vec4 u_transform; // (ax, ay, bx, by)
 uniform vec2 u_scale;
 uniform vec2 u_translate;
+uniform mat3 u_model; // Page space transform of the points, for selections being dragged
 
 void main()
 {
+	vec2 a_point = (u_model * vec3(a_x, a_y, 1.0)).xy;
 	float x = ((a_point.x * u_scale.x + u_translate.x) - u_transform.x) / (u_transform.z * 0.5);
 	float y = (u_transform.y - (a_point.y * u_scale.y + u_translate.y)) / (u_transform.w * 0.5);
 	gl_Position = vec4(x, y, 0.0, 1.0);
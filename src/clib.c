@@ -4,238 +4,995 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// ---------- Block pool ----------
+
+typedef struct clib_block_pool_size
+{
+	u64 block_size;
+	clib_arena_block *first_block;
+} clib_block_pool_size;
+
+static struct
+{
+	pthread_mutex_t mutex;
+	clib_block_pool_size sizes[CLIB_BLOCK_POOL_NUM_SIZES];
+	u64 total_size;
+} clib_block_pool = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+void *clib_block_pool_get(u64 block_size)
+{
+	clib_arena_block *block = NULL;
+
+	pthread_mutex_lock(&clib_block_pool.mutex);
+	for (u64 i = 0; i < CLIB_BLOCK_POOL_NUM_SIZES; i++)
+	{
+		clib_block_pool_size *size = &clib_block_pool.sizes[i];
+		if (size->block_size == block_size && size->first_block != NULL)
+		{
+			block = size->first_block;
+			size->first_block = block->next_block;
+			clib_block_pool.total_size -= block_size;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&clib_block_pool.mutex);
+
+	if (block == NULL)
+	{
+		block = malloc(block_size);
+		CLIB_ASSERT(block, "Failed to malloc new block");
+	}
+
+	block->next_block = NULL;
+	return block;
+}
+
+void clib_block_pool_put(void *block, u64 block_size)
+{
+	if (block == NULL) return;
+
+	pthread_mutex_lock(&clib_block_pool.mutex);
+	if (clib_block_pool.total_size + block_size <= CLIB_BLOCK_POOL_MAX_SIZE)
+	{
+		// Use the list for this size, or claim an empty one
+		clib_block_pool_size *size = NULL;
+		for (u64 i = 0; i < CLIB_BLOCK_POOL_NUM_SIZES; i++)
+		{
+			clib_block_pool_size *candidate = &clib_block_pool.sizes[i];
+			if (candidate->block_size == block_size)
+			{
+				size = candidate;
+				break;
+			}
+			if (size == NULL && candidate->first_block == NULL)
+				size = candidate;
+		}
+
+		if (size != NULL)
+		{
+			size->block_size = block_size;
+			((clib_arena_block*)block)->next_block = size->first_block;
+			size->first_block = block;
+			clib_block_pool.total_size += block_size;
+			block = NULL;
+		}
+	}
+	pthread_mutex_unlock(&clib_block_pool.mutex);
+
+	// Pool is full, or it's already keeping too many other sizes
+	free(block);
+}
+
+void clib_block_pool_trim()
+{
+	pthread_mutex_lock(&clib_block_pool.mutex);
+	for (u64 i = 0; i < CLIB_BLOCK_POOL_NUM_SIZES; i++)
+	{
+		clib_arena_block *block = clib_block_pool.sizes[i].first_block;
+		while (block != NULL)
+		{
+			clib_arena_block *next_block = block->next_block;
+			free(block);
+			block = next_block;
+		}
+		clib_block_pool.sizes[i] = (clib_block_pool_size){0};
+	}
+	clib_block_pool.total_size = 0;
+	pthread_mutex_unlock(&clib_block_pool.mutex);
+}
 
 // ---------- Arenas ----------
 
+#ifdef CLIB_ARENA_TELEMETRY
+
+// These are the real functions that the telemetry macros in clib.h stand in for
+#undef clib_arena_alloc
+#undef clib_arena_calloc
+#undef clib_arena_alloc_aligned
+
+static void clib_arena_telemetry_init(clib_arena *a, u64 block_size)
+{
+	a->telemetry = calloc(1, sizeof(clib_arena_telemetry));
+	CLIB_ASSERT(a->telemetry, "Failed to allocate arena telemetry");
+	a->telemetry->block_size = block_size;
+	a->telemetry->peak_block_size = block_size;
+}
+
+static void clib_arena_telemetry_set_block_size(clib_arena *a, u64 block_size)
+{
+	a->telemetry->block_size = block_size;
+	if (block_size > a->telemetry->peak_block_size)
+		a->telemetry->peak_block_size = block_size;
+}
+
+static clib_arena_site *clib_arena_telemetry_site(clib_arena *a, const char *file, u32 line)
+{
+	clib_arena_telemetry *t = a->telemetry;
+
+	// Open addressing on the file name pointer and line, every call site has its own __FILE__ string
+	u64 hash = ((u64)file ^ ((u64)line * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull;
+	for (u64 i = 0; i < CLIB_ARENA_TELEMETRY_MAX_SITES; i++)
+	{
+		clib_arena_site *site = &t->sites[(hash + i) & (CLIB_ARENA_TELEMETRY_MAX_SITES - 1)];
+		if (site->num_allocations == 0)
+		{
+			site->file = file;
+			site->line = line;
+			t->num_sites++;
+			return site;
+		}
+		if (site->file == file && site->line == line)
+			return site;
+	}
+
+	return NULL;
+}
+
+static void clib_arena_telemetry_record_alloc(clib_arena *a, u64 size, const char *file, u32 line)
+{
+	clib_arena_telemetry *t = a->telemetry;
+	if (a->total_allocation_size > t->peak_allocation_size)
+		t->peak_allocation_size = a->total_allocation_size;
+	if (a->num_allocations > t->peak_num_allocations)
+		t->peak_num_allocations = a->num_allocations;
+
+	clib_arena_site *site = clib_arena_telemetry_site(a, file, line);
+	if (site == NULL)
+	{
+		t->num_dropped_sites++;
+		return;
+	}
+
+	u64 bucket = 63 - __builtin_clzll(size);
+	if (bucket >= CLIB_ARENA_TELEMETRY_NUM_BUCKETS)
+		bucket = CLIB_ARENA_TELEMETRY_NUM_BUCKETS - 1;
+
+	site->num_allocations++;
+	site->total_size += size;
+	site->histogram[bucket]++;
+}
+
+#endif
+
+// Where the first chunk in a block goes, its allocation has to be aligned
+static u64 clib_arena_block_start(u64 metadata_size)
+{
+	u64 aligned = (metadata_size + CLIB_ARENA_CHUNK_HEADER_SIZE + CLIB_ARENA_ALIGNMENT - 1) & ~(CLIB_ARENA_ALIGNMENT - 1);
+	return aligned - CLIB_ARENA_CHUNK_HEADER_SIZE;
+}
+
 clib_arena *clib_arena_init(u64 block_size)
+{
+	return clib_arena_init_growing(block_size, block_size);
+}
+
+clib_arena *clib_arena_init_growing(u64 block_size, u64 max_block_size)
 {
 	CLIB_ASSERT(block_size > 0, "block_size is 0");
-	CLIB_ASSERT(block_size > sizeof(clib_arena), "block_size is too small to fit arena metadata");
+	CLIB_ASSERT(max_block_size >= block_size, "max_block_size is smaller than block_size");
+
+	// Chunk sizes are multiples of the alignment so their low bits can hold flags
+	block_size &= ~(CLIB_ARENA_ALIGNMENT - 1);
+	max_block_size &= ~(CLIB_ARENA_ALIGNMENT - 1);
+	CLIB_ASSERT(block_size > clib_arena_block_start(sizeof(clib_arena)) + CLIB_ARENA_CHUNK_HEADER_SIZE, "block_size is too small to fit arena metadata");
 
 	clib_arena *a;
-	a = malloc(block_size);
-	CLIB_ASSERT(a, "Failed to allocate block");
+	a = clib_block_pool_get(block_size);
 
 	*a = (clib_arena){0};
+	a->block.block_size = block_size;
 	a->current_block = (clib_arena_block*)a;
-	a->current_index = sizeof(clib_arena);
+	a->current_index = clib_arena_block_start(sizeof(clib_arena));
 	a->block_size = block_size;
+	a->max_block_size = max_block_size;
+	a->next_block_size = block_size * 2 < max_block_size ? block_size * 2 : max_block_size;
+#ifdef CLIB_ARENA_TELEMETRY
+	clib_arena_telemetry_init(a, block_size);
+#endif
+
+	return a;
+}
+
+clib_arena *clib_arena_init_virtual(u64 reserve_size)
+{
+	u64 page_size = sysconf(_SC_PAGESIZE);
+	CLIB_ASSERT(CLIB_ARENA_COMMIT_SIZE % page_size == 0, "CLIB_ARENA_COMMIT_SIZE isn't a multiple of the page size");
+
+	reserve_size = (reserve_size + CLIB_ARENA_COMMIT_SIZE - 1) & ~(u64)(CLIB_ARENA_COMMIT_SIZE - 1);
+	CLIB_ASSERT(reserve_size > 0, "reserve_size is 0");
+
+	// Only reserves address space, nothing is backed by memory until it's committed
+	void *range = mmap(NULL, reserve_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	CLIB_ASSERT(range != MAP_FAILED, "Failed to reserve virtual arena");
+
+	i32 result = mprotect(range, CLIB_ARENA_COMMIT_SIZE, PROT_READ | PROT_WRITE);
+	CLIB_ASSERT(result == 0, "Failed to commit virtual arena");
+
+	clib_arena *a = range;
+	*a = (clib_arena){0};
+	a->current_block = (clib_arena_block*)a;
+	a->current_index = clib_arena_block_start(sizeof(clib_arena));
+	a->block.block_size = reserve_size;
+	a->block_size = reserve_size;
+	a->max_block_size = reserve_size;
+	a->next_block_size = reserve_size;
+	a->is_virtual = 1;
+	a->committed_size = CLIB_ARENA_COMMIT_SIZE;
+#ifdef CLIB_ARENA_TELEMETRY
+	clib_arena_telemetry_init(a, a->committed_size);
+#endif
 
 	return a;
 }
 
+// Makes sure the first size bytes of a virtual arena can be used
+static void clib_arena_commit(clib_arena *a, u64 size)
+{
+	if (size <= a->committed_size) return;
+
+	u64 new_committed_size = (size + CLIB_ARENA_COMMIT_SIZE - 1) & ~(u64)(CLIB_ARENA_COMMIT_SIZE - 1);
+	if (new_committed_size > a->block_size)
+		new_committed_size = a->block_size;
+
+	i32 result = mprotect((void*)a + a->committed_size, new_committed_size - a->committed_size, PROT_READ | PROT_WRITE);
+	CLIB_ASSERT(result == 0, "Failed to commit virtual arena");
+
+	a->committed_size = new_committed_size;
+#ifdef CLIB_ARENA_TELEMETRY
+	clib_arena_telemetry_set_block_size(a, a->committed_size);
+#endif
+}
+
 void clib_arena_destroy(clib_arena **a)
 {
 	CLIB_ASSERT(a, "a is NULL");
+
+#ifdef CLIB_ARENA_TELEMETRY
+	if (*a != NULL)
+		free((*a)->telemetry);
+#endif
+
+	if (*a != NULL && (*a)->is_virtual)
+	{
+		munmap(*a, (*a)->block_size);
+		*a = NULL;
+		return;
+	}
 	
 	clib_arena_block *block = (clib_arena_block*)(*a);
 	while (block != NULL)
 	{
 		clib_arena_block *next_block = block->next_block;
-		free(block);
+		clib_block_pool_put(block, block->block_size);
 		block = next_block;
 	}
 
 	*a = NULL;
 }
 
+void clib_arena_shrink(clib_arena *a)
+{
+	CLIB_ASSERT(a, "a is NULL");
+
+	if (a->is_virtual)
+	{
+		// Keep the page the end of the arena is in, and the first commit step with the arena in it
+		u64 page_size = sysconf(_SC_PAGESIZE);
+		u64 used_size = (a->current_index + page_size - 1) & ~(page_size - 1);
+		if (used_size < CLIB_ARENA_COMMIT_SIZE)
+			used_size = CLIB_ARENA_COMMIT_SIZE;
+
+		if (a->committed_size > used_size)
+		{
+			void *unused = (void*)a + used_size;
+			madvise(unused, a->committed_size - used_size, MADV_DONTNEED);
+			i32 result = mprotect(unused, a->committed_size - used_size, PROT_NONE);
+			CLIB_ASSERT(result == 0, "Failed to decommit virtual arena");
+			a->committed_size = used_size;
+#ifdef CLIB_ARENA_TELEMETRY
+			clib_arena_telemetry_set_block_size(a, a->committed_size);
+#endif
+		}
+		return;
+	}
+
+	// Blocks after the current one never hold allocations or free chunks,
+	// the arena only moves back onto them after a reset or a scratch marker is restored
+	clib_arena_block *block = a->current_block->next_block;
+	a->current_block->next_block = NULL;
+	while (block != NULL)
+	{
+		clib_arena_block *next_block = block->next_block;
+#ifdef CLIB_ARENA_TELEMETRY
+		clib_arena_telemetry_set_block_size(a, a->telemetry->block_size - block->block_size);
+#endif
+		clib_block_pool_put(block, block->block_size);
+		a->num_extra_blocks_allocated--;
+		block = next_block;
+	}
+
+	// Grow from the last block that's left again
+	a->next_block_size = a->current_block->block_size * 2;
+	if (a->next_block_size > a->max_block_size)
+		a->next_block_size = a->max_block_size;
+}
+
 void clib_arena_reset(clib_arena *a)
 {
 	CLIB_ASSERT(a, "a is NULL");
+	CLIB_ASSERT(a->scratch_depth == 0, "Can't reset an arena with scratch markers open");
 	a->current_block = (clib_arena_block*)a;
-	a->current_index = sizeof(clib_arena);
+	a->current_index = clib_arena_block_start(sizeof(clib_arena));
+
+	// Every free region is inside a block that's now empty again
+	memset(a->freelists, 0, sizeof(a->freelists));
+	a->freelist_bitmap = 0;
 	a->total_allocation_size = 0;
 	a->num_allocations = 0;
+
+	// Pages stay committed, but the OS can take their memory back until they're touched again.
+	// The first pages hold the arena itself so they're kept.
+	if (a->is_virtual && a->committed_size > CLIB_ARENA_COMMIT_SIZE)
+		madvise((void*)a + CLIB_ARENA_COMMIT_SIZE, a->committed_size - CLIB_ARENA_COMMIT_SIZE, MADV_DONTNEED);
 }
 
-void clib_arena_start_scratch(clib_arena *a)
+clib_arena_marker clib_arena_mark(clib_arena *a)
 {
 	CLIB_ASSERT(a, "a is NULL");
-	CLIB_ASSERT(a->scratch_block == NULL, "There is already a scratch block");
+
+	clib_arena_marker marker = {
+		.arena = a,
+		.depth = ++a->scratch_depth,
+		.prev_block = a->scratch_block,
+		.prev_index = a->scratch_index,
+		.prev_total_allocation_size = a->scratch_total_allocation_size,
+		.prev_num_allocations = a->scratch_num_allocations,
+	};
 
 	a->scratch_block = a->current_block;
 	a->scratch_index = a->current_index;
 	a->scratch_total_allocation_size = a->total_allocation_size;
 	a->scratch_num_allocations = a->num_allocations;
+
+#ifdef CLIB_ARENA_TELEMETRY
+	if (a->scratch_depth > a->telemetry->peak_scratch_depth)
+		a->telemetry->peak_scratch_depth = a->scratch_depth;
+#endif
+
+	return marker;
 }
 
-void clib_arena_stop_scratch(clib_arena *a)
+void clib_arena_restore(clib_arena_marker *marker)
 {
-	CLIB_ASSERT(a, "a is NULL");
-	CLIB_ASSERT(a->scratch_block != NULL, "There is no scratch block");
+	CLIB_ASSERT(marker, "marker is NULL");
+	clib_arena *a = marker->arena;
+	CLIB_ASSERT(a, "marker wasn't taken");
+	CLIB_ASSERT(marker->depth == a->scratch_depth, "Scratch markers must be restored in reverse order");
 
 	a->current_block = a->scratch_block;
 	a->current_index = a->scratch_index;
 	a->total_allocation_size = a->scratch_total_allocation_size;
 	a->num_allocations = a->scratch_num_allocations;
 
-	a->scratch_block = NULL;
-	a->scratch_index = 0;
-	a->scratch_total_allocation_size = 0;
-	a->scratch_num_allocations = 0;
+	a->scratch_block = marker->prev_block;
+	a->scratch_index = marker->prev_index;
+	a->scratch_total_allocation_size = marker->prev_total_allocation_size;
+	a->scratch_num_allocations = marker->prev_num_allocations;
+	a->scratch_depth--;
+
+	*marker = (clib_arena_marker){0};
 }
 
 void clib_arena_print_info(clib_arena *a)
 {
 	CLIB_ASSERT(a, "a is NULL");
-	printf("Arena with block size %llu\n", a->block_size);
+	if (a->is_virtual)
+		printf("Virtual arena with %llu bytes reserved and %llu bytes committed\n", a->block_size, a->committed_size);
+	else if (a->max_block_size > a->block_size)
+		printf("Arena with block sizes from %llu up to %llu\n", a->block_size, a->max_block_size);
+	else
+		printf("Arena with block size %llu\n", a->block_size);
 	printf("\t%llu allocation(s)\n", a->num_allocations);
-	printf("\tin %llu block(s)\n", a->num_extra_blocks_allocated + 1);
+	if (a->is_virtual)
+		printf("\tin %llu block(s)\n", a->num_extra_blocks_allocated + 1);
+	else
+	{
+		u64 total_block_size = 0;
+		for (clib_arena_block *block = &a->block; block != NULL; block = block->next_block)
+			total_block_size += block->block_size;
+		printf("\tin %llu block(s) totalling %llu bytes\n", a->num_extra_blocks_allocated + 1, total_block_size);
+	}
 	printf("\ttotalling %llu bytes of user data\n", a->total_allocation_size);
 	printf("\tand %llu bytes of metadata\n", sizeof(clib_arena) + a->num_extra_blocks_allocated * sizeof(clib_arena_block));
 }
 
-void clib_arena_freelist_insert(clib_arena *a, clib_arena_freelist *f)
+static u64 clib_arena_size_class(u64 size)
+{
+	return 63 - __builtin_clzll(size);
+}
+
+static u64 clib_arena_chunk_size(clib_arena_chunk *c)
+{
+	return c->header & ~CLIB_ARENA_CHUNK_FLAGS;
+}
+
+static clib_arena_chunk *clib_arena_chunk_next(clib_arena_chunk *c)
+{
+	return (void*)c + clib_arena_chunk_size(c);
+}
+
+// Writes the header and, for free chunks, the boundary tag at the end
+static void clib_arena_chunk_set(clib_arena_chunk *c, u64 size, u64 flags)
+{
+	c->header = size | flags;
+	if (!(flags & CLIB_ARENA_CHUNK_IN_USE))
+		*(u64*)((void*)c + size - sizeof(u64)) = size;
+}
+
+static void clib_arena_freelist_insert(clib_arena *a, clib_arena_chunk *c)
 {
 	CLIB_ASSERT(a, "a is NULL");
-	CLIB_ASSERT(f, "f is NULL");
-	CLIB_ASSERT(f->size > 0, "f has size 0");
-
-	f->next = NULL;
-	f->prev = NULL;
-
-	// Loop through freelist
-	clib_arena_freelist *current = a->freelist;
-	while (current != NULL)
-	{
-		// If this element is bigger than the current one,
-		// is should be placed before it
-		// prev -> current becomes
-		// prev -> f -> current
-		// If prev doesn't exist then current must be the beginning!
-		// so a->freelist -> f -> current
-		if (f->size > current->size)
-		{
-			clib_arena_freelist *prev = current->prev;
+	CLIB_ASSERT(c, "c is NULL");
+	CLIB_ASSERT(clib_arena_chunk_size(c) >= CLIB_ARENA_CHUNK_MIN_SIZE, "c is too small to be free");
 
-			if (!prev)
-			{
-				a->freelist = f;
-				f->prev = NULL;
-				f->next = current;
-				return;
-			}
+	u64 size_class = clib_arena_size_class(clib_arena_chunk_size(c));
 
-			prev->next = f;
-			f->prev = prev;
-			f->next = current;
-			current->prev = f;
+	c->prev = NULL;
+	c->next = a->freelists[size_class];
+	if (c->next)
+		c->next->prev = c;
 
-			return;
-		}
+	a->freelists[size_class] = c;
+	a->freelist_bitmap |= 1ull << size_class;
+}
 
-		// If we make it here, we reached the end of the freelist
-		// without finding a smaller element. We must go at the end.
-		current->next = f;
-		f->prev = current;
-		return;
+static void clib_arena_freelist_remove(clib_arena *a, clib_arena_chunk *c)
+{
+	u64 size_class = clib_arena_size_class(clib_arena_chunk_size(c));
+
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		a->freelists[size_class] = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+
+	if (a->freelists[size_class] == NULL)
+		a->freelist_bitmap &= ~(1ull << size_class);
+}
+
+// Finds a free chunk of at least size bytes in O(1).
+// The head of size's own class is tried first as it's the closest fit,
+// otherwise any chunk from a bigger class is guaranteed to fit.
+static clib_arena_chunk *clib_arena_freelist_find(clib_arena *a, u64 size)
+{
+	u64 size_class = clib_arena_size_class(size);
+
+	clib_arena_chunk *c = a->freelists[size_class];
+	if (c && clib_arena_chunk_size(c) >= size)
+		return c;
+
+	if (size_class + 1 >= CLIB_ARENA_NUM_SIZE_CLASSES) return NULL;
+
+	u64 bigger = a->freelist_bitmap & ~((2ull << size_class) - 1);
+	if (bigger == 0) return NULL;
+
+	return a->freelists[__builtin_ctzll(bigger)];
+}
+
+// Free chunks are only created and reused while no scratch marker is open,
+// restoring a marker rewinds the arena over anything made after it
+static i32 clib_arena_freelist_frozen(clib_arena *a)
+{
+	return a->scratch_block != NULL;
+}
+
+static void *clib_arena_current_end(clib_arena *a)
+{
+	return (void*)a->current_block + a->current_index;
+}
+
+// Closes off the rest of the current block so every byte of it belongs to a chunk
+static void clib_arena_retire_block(clib_arena *a)
+{
+	u64 end = a->current_block->block_size - CLIB_ARENA_CHUNK_HEADER_SIZE;
+	u64 tail = end - a->current_index;
+	u64 sentinel_flags = CLIB_ARENA_CHUNK_IN_USE | CLIB_ARENA_CHUNK_PREV_IN_USE;
+
+#ifdef CLIB_ARENA_TELEMETRY
+	a->telemetry->tail_size += tail;
+	if (tail < CLIB_ARENA_CHUNK_MIN_SIZE || clib_arena_freelist_frozen(a))
+		a->telemetry->wasted_tail_size += tail;
+#endif
+
+	if (tail > 0)
+	{
+		clib_arena_chunk *c = clib_arena_current_end(a);
+
+		// If the wasted space at the end of the old block can hold
+		// a free chunk, add it to the freelist for future allocations.
+		// Otherwise it becomes a chunk that is never handed out.
+		if (tail >= CLIB_ARENA_CHUNK_MIN_SIZE && !clib_arena_freelist_frozen(a))
+		{
+			clib_arena_chunk_set(c, tail, CLIB_ARENA_CHUNK_PREV_IN_USE);
+			clib_arena_freelist_insert(a, c);
+			sentinel_flags = CLIB_ARENA_CHUNK_IN_USE;
+		}
+		else
+			clib_arena_chunk_set(c, tail, CLIB_ARENA_CHUNK_IN_USE | CLIB_ARENA_CHUNK_PREV_IN_USE);
 	}
-	// If we make it here, current was always NULL,
-	// meaning the freelist doesn't exist yet.
-	
-	a->freelist = f;
+
+	clib_arena_chunk_set((void*)a->current_block + end, 0, sentinel_flags);
 }
 
-void* clib_arena_alloc(clib_arena *a, u64 size)
+// How far a chunk at c has to move so its allocation is aligned to align.
+// The gap becomes a chunk of its own, so it can't be smaller than the minimum.
+static u64 clib_arena_align_padding(void *c, u64 align)
+{
+	if (align <= CLIB_ARENA_ALIGNMENT) return 0;
+
+	u64 misalignment = ((u64)c + CLIB_ARENA_CHUNK_HEADER_SIZE) & (align - 1);
+	if (misalignment == 0) return 0;
+
+	u64 padding = align - misalignment;
+	if (padding < CLIB_ARENA_CHUNK_MIN_SIZE)
+		padding += align;
+	return padding;
+}
+
+static void* clib_arena_alloc_internal(clib_arena *a, u64 size, u64 align)
 {
 	CLIB_ASSERT(a, "a is NULL");
 	CLIB_ASSERT(size > 0, "size is 0");
-	CLIB_ASSERT(size <= a->block_size, "allocation is too big to fit in a block");
-	CLIB_ASSERT((size + sizeof(clib_arena_block)) <= a->block_size, "allocation is too big to fit in a block alongside metadata");
 
-	clib_arena_freelist *freelist = a->freelist;
-	while (freelist != NULL)
+	u64 chunk_size = (size + CLIB_ARENA_CHUNK_HEADER_SIZE + CLIB_ARENA_ALIGNMENT - 1) & ~(CLIB_ARENA_ALIGNMENT - 1);
+	if (chunk_size < CLIB_ARENA_CHUNK_MIN_SIZE)
+		chunk_size = CLIB_ARENA_CHUNK_MIN_SIZE;
+
+	// Worst case padding needed in front of the chunk to align it
+	u64 max_padding = align > CLIB_ARENA_ALIGNMENT ? align + CLIB_ARENA_CHUNK_MIN_SIZE : 0;
+
+	// Size of a block that's guaranteed to fit the allocation
+	u64 needed_block_size = clib_arena_block_start(sizeof(clib_arena_block)) + max_padding + chunk_size + CLIB_ARENA_CHUNK_HEADER_SIZE;
+
+	CLIB_ASSERT(size <= a->max_block_size, "allocation is too big to fit in a block");
+	CLIB_ASSERT(needed_block_size <= a->max_block_size, "allocation is too big to fit in a block alongside metadata");
+
+	clib_arena_chunk *c = NULL;
+
+	if (a->freelist_bitmap && !clib_arena_freelist_frozen(a))
+		c = clib_arena_freelist_find(a, chunk_size + max_padding);
+
+	if (c != NULL)
 	{
-		// If it can't fit here, move on
-		if (size > freelist->size)
-		{
-			freelist = freelist->next;
-			continue;
-		}
+		clib_arena_freelist_remove(a, c);
 
-		// The allocation can now DEFINITELY fit in this freelist block
+		// Free chunks always follow a chunk that's in use, otherwise they'd have been merged
+		u64 free_size = clib_arena_chunk_size(c);
+		u64 prev_flag = CLIB_ARENA_CHUNK_PREV_IN_USE;
 
-		// Can it fit while keeping the freelist in tact?
-		if (size + sizeof(clib_arena_freelist) <= freelist->size)
+		u64 padding = clib_arena_align_padding(c, align);
+		if (padding > 0)
 		{
-			// Yes! Put it at the end of the free block, and shrink it
-			void *ptr = (void*)(freelist) + freelist->size - size;
-			freelist->size -= size;
-			a->num_allocations++;
-			a->total_allocation_size += size;
-			return ptr;
+			// The front of the free chunk stays free
+			clib_arena_chunk_set(c, padding, CLIB_ARENA_CHUNK_PREV_IN_USE);
+			clib_arena_freelist_insert(a, c);
+			c = (void*)c + padding;
+			free_size -= padding;
+			prev_flag = 0;
 		}
 
-		// Now we know the freelist block is big enough for the allocation,
-		// but too small to also contain enough metadata for a freelist block.
-		// Remove it from the freelist and give the memory to the allocation
-		
-		// Remove from linked list
-		if (freelist->prev)
-			freelist->prev->next = freelist->next;
+		if (free_size - chunk_size >= CLIB_ARENA_CHUNK_MIN_SIZE)
+		{
+			// Split it, the rest stays free
+			clib_arena_chunk_set(c, chunk_size, CLIB_ARENA_CHUNK_IN_USE | prev_flag);
+
+			clib_arena_chunk *rest = clib_arena_chunk_next(c);
+			clib_arena_chunk_set(rest, free_size - chunk_size, CLIB_ARENA_CHUNK_PREV_IN_USE);
+			clib_arena_freelist_insert(a, rest);
+		}
 		else
-			a->freelist = freelist->next;
-		if (freelist->next)
-			freelist->next->prev = freelist->prev;
+		{
+			// Too small to split, the allocation gets all of it
+			chunk_size = free_size;
+			clib_arena_chunk_set(c, chunk_size, CLIB_ARENA_CHUNK_IN_USE | prev_flag);
+			clib_arena_chunk_next(c)->header |= CLIB_ARENA_CHUNK_PREV_IN_USE;
+		}
 
 		a->num_allocations++;
-		a->total_allocation_size += size;
-		return (void*)freelist;
+		a->total_allocation_size += chunk_size - CLIB_ARENA_CHUNK_HEADER_SIZE;
+		return (void*)c + CLIB_ARENA_CHUNK_HEADER_SIZE;
 	}
 
+	u64 padding = clib_arena_align_padding(clib_arena_current_end(a), align);
+
 	// If it can't fit in current block, need a new one
-	if (a->current_index + size > a->block_size)
+	if (a->current_index + padding + chunk_size > a->current_block->block_size - CLIB_ARENA_CHUNK_HEADER_SIZE)
 	{
-		// If the wasted space at the end of the old block
-		// is more than sizeof(clib_freelist), add the space
-		// to the freelist for future allocations.
+		CLIB_ASSERT(!a->is_virtual, "Virtual arena ran out of reserved space");
 
-		u64 wasted_space = a->block_size - a->current_index;
-		if (wasted_space > sizeof(clib_arena_freelist))
-		{
-			clib_arena_freelist *free_spot = (void*)(a->current_block) + a->current_index;
-			free_spot->size = wasted_space;
-			free_spot->next = NULL;
-			free_spot->prev = NULL;
-			clib_arena_freelist_insert(a, free_spot);
-		}
+		clib_arena_retire_block(a);
 
 		// Now we need to actually get a new block...
-
-		// If there's already a next block, use that
-		if (a->current_block->next_block != NULL)
+		while (1)
 		{
-			a->current_block = a->current_block->next_block;
-			a->current_index = sizeof(clib_arena_block);
-		}
-		// Otherwise allocate a new block
-		else
-		{
-			clib_arena_block *new_block = malloc(a->block_size);
-			CLIB_ASSERT(new_block, "Failed to malloc new block");
+			clib_arena_block *next_block = a->current_block->next_block;
+
+			// If there's already a next block, use that
+			if (next_block != NULL)
+			{
+				a->current_block = next_block;
+				a->current_index = clib_arena_block_start(sizeof(clib_arena_block));
+				if (next_block->block_size >= needed_block_size) break;
+
+				// It's too small for this allocation, so skip over it
+				clib_arena_retire_block(a);
+				continue;
+			}
+
+			// Otherwise allocate a new block, bigger than the last one if the arena is growing
+			u64 block_size = a->next_block_size;
+			while (block_size < needed_block_size)
+				block_size = block_size * 2 < a->max_block_size ? block_size * 2 : a->max_block_size;
+			a->next_block_size = block_size * 2 < a->max_block_size ? block_size * 2 : a->max_block_size;
+
+			clib_arena_block *new_block = clib_block_pool_get(block_size);
+			new_block->block_size = block_size;
 			a->current_block->next_block = new_block;
 			a->current_block = new_block;
-			a->current_index = sizeof(clib_arena_block);
+			a->current_index = clib_arena_block_start(sizeof(clib_arena_block));
 			a->num_extra_blocks_allocated++;
+#ifdef CLIB_ARENA_TELEMETRY
+			clib_arena_telemetry_set_block_size(a, a->telemetry->block_size + block_size);
+#endif
+			break;
 		}
+
+		padding = clib_arena_align_padding(clib_arena_current_end(a), align);
 	}
 
+	if (a->is_virtual)
+		clib_arena_commit(a, a->current_index + padding + chunk_size);
+
 	// Now we definitely have a valid spot for the memory to go!
-	void *ptr = (void*)(a->current_block) + a->current_index;
-	a->current_index += size;
+	// The chunk before the end of the arena is always in use, frees next to it move the end back instead.
+	u64 prev_flag = CLIB_ARENA_CHUNK_PREV_IN_USE;
+	if (padding > 0)
+	{
+		clib_arena_chunk *gap = clib_arena_current_end(a);
+		if (clib_arena_freelist_frozen(a))
+			clib_arena_chunk_set(gap, padding, CLIB_ARENA_CHUNK_IN_USE | CLIB_ARENA_CHUNK_PREV_IN_USE);
+		else
+		{
+			clib_arena_chunk_set(gap, padding, CLIB_ARENA_CHUNK_PREV_IN_USE);
+			clib_arena_freelist_insert(a, gap);
+			prev_flag = 0;
+		}
+		a->current_index += padding;
+	}
+
+	c = clib_arena_current_end(a);
+	clib_arena_chunk_set(c, chunk_size, CLIB_ARENA_CHUNK_IN_USE | prev_flag);
+	a->current_index += chunk_size;
 	a->num_allocations++;
-	a->total_allocation_size += size;
+	a->total_allocation_size += chunk_size - CLIB_ARENA_CHUNK_HEADER_SIZE;
+	return (void*)c + CLIB_ARENA_CHUNK_HEADER_SIZE;
+}
+
+void* clib_arena_alloc(clib_arena *a, u64 size)
+{
+	void *ptr = clib_arena_alloc_internal(a, size, CLIB_ARENA_ALIGNMENT);
+#ifdef CLIB_ARENA_TELEMETRY
+	clib_arena_telemetry_record_alloc(a, size, NULL, 0);
+#endif
 	return ptr;
 }
 
+void* clib_arena_alloc_aligned(clib_arena *a, u64 size, u64 align)
+{
+	CLIB_ASSERT(align > 0 && (align & (align - 1)) == 0, "align isn't a power of two");
+	void *ptr = clib_arena_alloc_internal(a, size, align);
+#ifdef CLIB_ARENA_TELEMETRY
+	clib_arena_telemetry_record_alloc(a, size, NULL, 0);
+#endif
+	return ptr;
+}
+
+void clib_arena_free(clib_arena *a, void *ptr)
+{
+	CLIB_ASSERT(a, "a is NULL");
+	if (ptr == NULL) return;
+
+	clib_arena_chunk *c = ptr - CLIB_ARENA_CHUNK_HEADER_SIZE;
+	CLIB_ASSERT(c->header & CLIB_ARENA_CHUNK_IN_USE, "ptr isn't an allocation, or was already freed");
+#ifdef CLIB_ARENA_TELEMETRY
+	a->telemetry->num_frees++;
+#endif
+
+	u64 size = clib_arena_chunk_size(c);
+	clib_arena_chunk *next = clib_arena_chunk_next(c);
+
+	if (clib_arena_freelist_frozen(a))
+	{
+		// Only the end of the innermost scratch region can be given back, everything
+		// before its marker stays allocated until that marker is restored
+		i32 in_scratch = a->current_block != a->scratch_block ||
+			(void*)c >= (void*)a->scratch_block + a->scratch_index;
+
+		if ((void*)next != clib_arena_current_end(a) || !in_scratch) return;
+	}
+
+	a->num_allocations--;
+	a->total_allocation_size -= size - CLIB_ARENA_CHUNK_HEADER_SIZE;
+
+	// Fast path, the last allocation just moves the end of the arena back
+	if ((void*)next == clib_arena_current_end(a))
+	{
+		a->current_index -= size;
+
+		if (!(c->header & CLIB_ARENA_CHUNK_PREV_IN_USE))
+		{
+			u64 prev_size = *(u64*)((void*)c - sizeof(u64));
+			clib_arena_chunk *prev = (void*)c - prev_size;
+			clib_arena_freelist_remove(a, prev);
+			a->current_index -= prev_size;
+		}
+		return;
+	}
+
+	// Merge with the next chunk if it's free
+	if (!(next->header & CLIB_ARENA_CHUNK_IN_USE))
+	{
+		clib_arena_freelist_remove(a, next);
+		size += clib_arena_chunk_size(next);
+	}
+
+	// And the previous one
+	if (!(c->header & CLIB_ARENA_CHUNK_PREV_IN_USE))
+	{
+		u64 prev_size = *(u64*)((void*)c - sizeof(u64));
+		clib_arena_chunk *prev = (void*)c - prev_size;
+		clib_arena_freelist_remove(a, prev);
+		c = prev;
+		size += prev_size;
+	}
+
+	clib_arena_chunk_set(c, size, CLIB_ARENA_CHUNK_PREV_IN_USE);
+	clib_arena_chunk_next(c)->header &= ~CLIB_ARENA_CHUNK_PREV_IN_USE;
+	clib_arena_freelist_insert(a, c);
+}
+
 void* clib_arena_calloc(clib_arena *a, u64 size)
 {
 	CLIB_ASSERT(a, "a is NULL");
 	void *ptr = clib_arena_alloc(a, size);
-	memset(a, 0, size);
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+#ifdef CLIB_ARENA_TELEMETRY
+
+void* clib_arena_alloc_site(clib_arena *a, u64 size, u64 align, const char *file, u32 line)
+{
+	CLIB_ASSERT(align > 0 && (align & (align - 1)) == 0, "align isn't a power of two");
+	void *ptr = clib_arena_alloc_internal(a, size, align);
+	clib_arena_telemetry_record_alloc(a, size, file, line);
 	return ptr;
 }
 
+void* clib_arena_calloc_site(clib_arena *a, u64 size, const char *file, u32 line)
+{
+	void *ptr = clib_arena_alloc_site(a, size, CLIB_ARENA_ALIGNMENT, file, line);
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+void clib_arena_telemetry_write_json(clib_arena *a, FILE *file)
+{
+	CLIB_ASSERT(a, "a is NULL");
+	CLIB_ASSERT(file, "file is NULL");
+	clib_arena_telemetry *t = a->telemetry;
+
+	// Fragmentation is how much of the free space can't be handed out as one allocation
+	u64 free_size = 0, num_free_chunks = 0, largest_free_chunk = 0;
+	for (u64 i = 0; i < CLIB_ARENA_NUM_SIZE_CLASSES; i++)
+	{
+		for (clib_arena_chunk *c = a->freelists[i]; c != NULL; c = c->next)
+		{
+			u64 size = clib_arena_chunk_size(c);
+			free_size += size;
+			num_free_chunks++;
+			if (size > largest_free_chunk)
+				largest_free_chunk = size;
+		}
+	}
+	f64 fragmentation = free_size ? 1.0 - (f64)largest_free_chunk / (f64)free_size : 0.0;
+
+	fprintf(file, "{\"virtual\": %s, \"block_size\": %llu, \"max_block_size\": %llu, \"num_blocks\": %llu,\n",
+		a->is_virtual ? "true" : "false", a->block_size, a->max_block_size, a->num_extra_blocks_allocated + 1);
+	fprintf(file, " \"allocation_size\": %llu, \"num_allocations\": %llu, \"num_frees\": %llu,\n",
+		a->total_allocation_size, a->num_allocations, t->num_frees);
+	fprintf(file, " \"peak_allocation_size\": %llu, \"peak_num_allocations\": %llu, \"peak_scratch_depth\": %llu,\n",
+		t->peak_allocation_size, t->peak_num_allocations, t->peak_scratch_depth);
+	fprintf(file, " \"block_bytes\": %llu, \"peak_block_bytes\": %llu, \"tail_size\": %llu, \"wasted_tail_size\": %llu,\n",
+		t->block_size, t->peak_block_size, t->tail_size, t->wasted_tail_size);
+	fprintf(file, " \"free_size\": %llu, \"num_free_chunks\": %llu, \"largest_free_chunk\": %llu, \"fragmentation\": %.4f,\n",
+		free_size, num_free_chunks, largest_free_chunk, fragmentation);
+	fprintf(file, " \"num_dropped_sites\": %llu, \"sites\": [", t->num_dropped_sites);
+
+	i32 first = 1;
+	for (u64 i = 0; i < CLIB_ARENA_TELEMETRY_MAX_SITES; i++)
+	{
+		clib_arena_site *site = &t->sites[i];
+		if (site->num_allocations == 0) continue;
+
+		fprintf(file, "%s\n  {\"file\": \"%s\", \"line\": %u, \"num_allocations\": %llu, \"total_size\": %llu, \"histogram\": {",
+			first ? "" : ",", site->file ? site->file : "clib", site->line, site->num_allocations, site->total_size);
+		first = 0;
+
+		// Keys are the smallest size in each bucket
+		i32 first_bucket = 1;
+		for (u64 j = 0; j < CLIB_ARENA_TELEMETRY_NUM_BUCKETS; j++)
+		{
+			if (site->histogram[j] == 0) continue;
+			fprintf(file, "%s\"%llu\": %llu", first_bucket ? "" : ", ", 1ull << j, site->histogram[j]);
+			first_bucket = 0;
+		}
+		fprintf(file, "}}");
+	}
+	fprintf(file, "\n ]}");
+}
+
+#endif
+
+// ---------- Concurrent arenas ----------
+
+static u64 clib_concurrent_block_start()
+{
+	return (sizeof(clib_concurrent_block) + CLIB_ARENA_ALIGNMENT - 1) & ~(CLIB_ARENA_ALIGNMENT - 1);
+}
+
+static clib_concurrent_block *clib_concurrent_block_new(u64 block_size)
+{
+	clib_concurrent_block *block = clib_block_pool_get(block_size);
+	atomic_init(&block->next_block, NULL);
+	atomic_init(&block->index, clib_concurrent_block_start());
+	return block;
+}
+
+void clib_concurrent_arena_init(clib_concurrent_arena *a, u64 block_size)
+{
+	CLIB_ASSERT(a, "a is NULL");
+	CLIB_ASSERT(block_size > clib_concurrent_block_start(), "block_size is too small to fit block metadata");
+
+	a->block_size = block_size & ~(CLIB_ARENA_ALIGNMENT - 1);
+	a->first_block = clib_concurrent_block_new(a->block_size);
+	atomic_init(&a->current_block, a->first_block);
+	atomic_init(&a->num_blocks, 1);
+}
+
+void clib_concurrent_arena_destroy(clib_concurrent_arena *a)
+{
+	CLIB_ASSERT(a, "a is NULL");
+
+	clib_concurrent_block *block = a->first_block;
+	while (block != NULL)
+	{
+		clib_concurrent_block *next_block = atomic_load_explicit(&block->next_block, memory_order_relaxed);
+		clib_block_pool_put(block, a->block_size);
+		block = next_block;
+	}
+
+	*a = (clib_concurrent_arena){0};
+}
+
+void clib_concurrent_arena_reset(clib_concurrent_arena *a)
+{
+	CLIB_ASSERT(a, "a is NULL");
+
+	// Blocks are kept and used again in the same order
+	for (clib_concurrent_block *block = a->first_block; block != NULL; block = atomic_load(&block->next_block))
+		atomic_store(&block->index, clib_concurrent_block_start());
+	atomic_store(&a->current_block, a->first_block);
+}
+
+void *clib_concurrent_arena_alloc(clib_concurrent_arena *a, u64 size)
+{
+	CLIB_ASSERT(a, "a is NULL");
+	CLIB_ASSERT(size > 0, "size is 0");
+
+	size = (size + CLIB_ARENA_ALIGNMENT - 1) & ~(CLIB_ARENA_ALIGNMENT - 1);
+	CLIB_ASSERT(clib_concurrent_block_start() + size <= a->block_size, "allocation is too big to fit in a block");
+
+	while (1)
+	{
+		clib_concurrent_block *block = atomic_load_explicit(&a->current_block, memory_order_acquire);
+
+		u64 index = atomic_fetch_add_explicit(&block->index, size, memory_order_relaxed);
+		if (index + size <= a->block_size)
+			return (void*)block + index;
+
+		// The block is full. Whichever thread gets there first links up the next one,
+		// anyone who loses the race gives theirs back.
+		clib_concurrent_block *next_block = atomic_load_explicit(&block->next_block, memory_order_acquire);
+		if (next_block == NULL)
+		{
+			clib_concurrent_block *new_block = clib_concurrent_block_new(a->block_size);
+			if (atomic_compare_exchange_strong_explicit(&block->next_block, &next_block, new_block, memory_order_acq_rel, memory_order_acquire))
+			{
+				next_block = new_block;
+				atomic_fetch_add_explicit(&a->num_blocks, 1, memory_order_relaxed);
+			}
+			else
+				clib_block_pool_put(new_block, a->block_size);
+		}
+
+		// Fails if someone else already moved the arena on, either way try again
+		atomic_compare_exchange_strong_explicit(&a->current_block, &block, next_block, memory_order_acq_rel, memory_order_acquire);
+	}
+}
+
+void clib_concurrent_cache_init(clib_concurrent_cache *cache, clib_concurrent_arena *a)
+{
+	CLIB_ASSERT(cache, "cache is NULL");
+	CLIB_ASSERT(a, "a is NULL");
+
+	*cache = (clib_concurrent_cache){0};
+	cache->arena = a;
+}
+
+void *clib_concurrent_cache_alloc(clib_concurrent_cache *cache, u64 size)
+{
+	CLIB_ASSERT(cache, "cache is NULL");
+	CLIB_ASSERT(size > 0, "size is 0");
+
+	size = (size + CLIB_ARENA_ALIGNMENT - 1) & ~(CLIB_ARENA_ALIGNMENT - 1);
+
+	if (cache->current != NULL && size <= (u64)(cache->end - cache->current))
+	{
+		void *ptr = cache->current;
+		cache->current += size;
+		return ptr;
+	}
+
+	// Big allocations go straight to the arena so the rest of the chunk isn't wasted
+	if (size > CLIB_CONCURRENT_CHUNK_SIZE / 4)
+		return clib_concurrent_arena_alloc(cache->arena, size);
+
+	u8 *chunk = clib_concurrent_arena_alloc(cache->arena, CLIB_CONCURRENT_CHUNK_SIZE);
+	cache->current = chunk + size;
+	cache->end = chunk + CLIB_CONCURRENT_CHUNK_SIZE;
+	return chunk;
+}
+
 // ---------- Vectors ----------
 
 void clib_vector_init(clib_vector *vector, u64 type)
@@ -322,6 +1079,260 @@ void clib_vector_pop(clib_vector *vector)
 	vector->count--;
 }
 
+// ---------- Thread scratch ----------
+
+static _Thread_local clib_arena *clib_thread_scratch_arena;
+static pthread_key_t clib_thread_scratch_key;
+static pthread_once_t clib_thread_scratch_once = PTHREAD_ONCE_INIT;
+
+static void clib_thread_scratch_destroy(void *arena)
+{
+	clib_arena *a = arena;
+	clib_arena_destroy(&a);
+}
+
+static void clib_thread_scratch_init()
+{
+	CLIB_ASSERT(pthread_key_create(&clib_thread_scratch_key, clib_thread_scratch_destroy) == 0, "Failed to create thread scratch key");
+}
+
+clib_arena *clib_thread_scratch()
+{
+	if (clib_thread_scratch_arena == NULL)
+	{
+		pthread_once(&clib_thread_scratch_once, clib_thread_scratch_init);
+		clib_thread_scratch_arena = clib_arena_init_virtual(CLIB_THREAD_SCRATCH_SIZE);
+
+		// The key only exists so the arena gets destroyed when the thread exits
+		pthread_setspecific(clib_thread_scratch_key, clib_thread_scratch_arena);
+	}
+	return clib_thread_scratch_arena;
+}
+
+// ---------- Thread pool ----------
+
+u64 clib_num_cores()
+{
+	i64 cores = sysconf(_SC_NPROCESSORS_ONLN);
+	return cores > 0 ? (u64)cores : 1;
+}
+
+// Runs a job, then throws away whatever it left in this thread's scratch arena.
+// The caller of clib_pool_run can have its own markers open, so the job gets a marker
+// of its own rather than resetting the arena.
+static void clib_pool_run_job(clib_job_func func, void *data, u64 index)
+{
+	clib_arena *scratch = clib_thread_scratch_arena;
+	clib_arena_marker marker = {0};
+	if (scratch)
+		marker = clib_arena_mark(scratch);
+
+	func(data, index);
+
+	if (scratch)
+		clib_arena_restore(&marker);
+	else if (clib_thread_scratch_arena)
+	{
+		// The job created the arena, so nothing else can be using it
+		CLIB_ASSERT(clib_thread_scratch_arena->scratch_depth == 0, "Job left a scratch marker open");
+		clib_arena_reset(clib_thread_scratch_arena);
+	}
+}
+
+// Runs jobs from the current batch until there are none left to hand out.
+// Must be called with pool->mutex held, returns with it held.
+static void clib_pool_work(clib_pool *pool)
+{
+	while (pool->next_job < pool->num_jobs)
+	{
+		u64 index = pool->next_job++;
+		clib_job_func func = pool->func;
+		void *data = pool->data;
+
+		pthread_mutex_unlock(&pool->mutex);
+		clib_pool_run_job(func, data, index);
+		pthread_mutex_lock(&pool->mutex);
+
+		pool->num_done++;
+		if (pool->num_done == pool->num_jobs)
+			pthread_cond_broadcast(&pool->done_cond);
+	}
+}
+
+static void *clib_pool_thread(void *arg)
+{
+	clib_pool *pool = arg;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (!pool->quit)
+	{
+		if (pool->next_job < pool->num_jobs)
+			clib_pool_work(pool);
+		else
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+void clib_pool_init(clib_pool *pool, u64 num_threads)
+{
+	CLIB_ASSERT(pool, "pool is NULL");
+
+	*pool = (clib_pool){0};
+	if (num_threads == 0)
+		num_threads = clib_num_cores();
+
+	// The caller of clib_pool_run is one of the threads
+	pool->num_threads = num_threads - 1;
+
+	CLIB_ASSERT(pthread_mutex_init(&pool->mutex, NULL) == 0, "Failed to create mutex");
+	CLIB_ASSERT(pthread_mutex_init(&pool->run_mutex, NULL) == 0, "Failed to create mutex");
+	CLIB_ASSERT(pthread_cond_init(&pool->work_cond, NULL) == 0, "Failed to create condition variable");
+	CLIB_ASSERT(pthread_cond_init(&pool->done_cond, NULL) == 0, "Failed to create condition variable");
+
+	if (pool->num_threads == 0) return;
+
+	pool->threads = malloc(pool->num_threads * sizeof(pthread_t));
+	CLIB_ASSERT(pool->threads, "malloc failed");
+
+	for (u64 i = 0; i < pool->num_threads; i++)
+		CLIB_ASSERT(pthread_create(&pool->threads[i], NULL, clib_pool_thread, pool) == 0, "Failed to create thread");
+}
+
+void clib_pool_destroy(clib_pool *pool)
+{
+	CLIB_ASSERT(pool, "pool is NULL");
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (u64 i = 0; i < pool->num_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+	free(pool->threads);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->run_mutex);
+	pthread_mutex_destroy(&pool->mutex);
+
+	*pool = (clib_pool){0};
+}
+
+void clib_pool_run(clib_pool *pool, u64 num_jobs, clib_job_func func, void *data)
+{
+	CLIB_ASSERT(func, "func is NULL");
+
+	if (pool == NULL || pool->num_threads == 0 || num_jobs <= 1)
+	{
+		for (u64 i = 0; i < num_jobs; i++)
+			clib_pool_run_job(func, data, i);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->run_mutex);
+	pthread_mutex_lock(&pool->mutex);
+
+	pool->func = func;
+	pool->data = data;
+	pool->num_jobs = num_jobs;
+	pool->next_job = 0;
+	pool->num_done = 0;
+	pthread_cond_broadcast(&pool->work_cond);
+
+	clib_pool_work(pool);
+	while (pool->num_done < pool->num_jobs)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+
+	pool->func = NULL;
+	pool->data = NULL;
+	pool->num_jobs = 0;
+	pool->next_job = 0;
+	pool->num_done = 0;
+
+	pthread_mutex_unlock(&pool->mutex);
+	pthread_mutex_unlock(&pool->run_mutex);
+}
+
+// ---------- Checksums ----------
+
+static u32 clib_crc32c_table[256];
+static pthread_once_t clib_crc32c_once = PTHREAD_ONCE_INIT;
+static i32 clib_crc32c_has_sse42;
+
+static void clib_crc32c_init()
+{
+	// Reflected Castagnoli polynomial
+	for (u32 i = 0; i < 256; i++)
+	{
+		u32 crc = i;
+		for (u32 j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+		clib_crc32c_table[i] = crc;
+	}
+
+#if defined(__x86_64__)
+	clib_crc32c_has_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static u32 clib_crc32c_table_update(u32 crc, const u8 *data, u64 size)
+{
+	for (u64 i = 0; i < size; i++)
+		crc = (crc >> 8) ^ clib_crc32c_table[(crc ^ data[i]) & 0xff];
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static u32 clib_crc32c_sse42_update(u32 crc, const u8 *data, u64 size)
+{
+	u64 crc64 = crc;
+
+	// Byte at a time up to 8 byte alignment, then 8 bytes per instruction
+	while (size > 0 && ((u64)data & 7) != 0)
+	{
+		crc64 = _mm_crc32_u8((u32)crc64, *data);
+		data++;
+		size--;
+	}
+
+	while (size >= 8)
+	{
+		u64 value;
+		memcpy(&value, data, 8);
+		crc64 = _mm_crc32_u64(crc64, value);
+		data += 8;
+		size -= 8;
+	}
+
+	while (size > 0)
+	{
+		crc64 = _mm_crc32_u8((u32)crc64, *data);
+		data++;
+		size--;
+	}
+
+	return (u32)crc64;
+}
+#endif
+
+u32 clib_crc32c(u32 crc, const void *data, u64 size)
+{
+	CLIB_ASSERT(data || size == 0, "data is NULL");
+	pthread_once(&clib_crc32c_once, clib_crc32c_init);
+
+	crc = ~crc;
+#if defined(__x86_64__)
+	if (clib_crc32c_has_sse42)
+		return ~clib_crc32c_sse42_update(crc, data, size);
+#endif
+	return ~clib_crc32c_table_update(crc, data, size);
+}
+
 // ---------- Random numbers ----------
 
 void clib_prng_init(clib_prng *rng)
@@ -417,3 +1428,70 @@ i32 clib_file_read(clib_arena *arena, const char *path, char **out_data, u64 *ou
 
 	return 1;
 }
+
+
+i32 clib_file_write_atomic(const char *path, const void *data, u64 size)
+{
+	char tmp_path[4096];
+	char dir_path[4096];
+	i32 fd;
+
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (i32)sizeof(tmp_path))
+	{
+		printf("Warning: Path too long %s\n", path);
+		return 0;
+	}
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		printf("Warning: Failed to open file %s\n", tmp_path);
+		return 0;
+	}
+
+	u64 written = 0;
+	while (written < size)
+	{
+		i64 ret = write(fd, (const char*)data + written, size - written);
+		if (ret <= 0)
+		{
+			printf("Warning: Failed to write file %s\n", tmp_path);
+			close(fd);
+			unlink(tmp_path);
+			return 0;
+		}
+		written += (u64)ret;
+	}
+
+	if (fsync(fd) != 0)
+	{
+		printf("Warning: Failed to sync file %s\n", tmp_path);
+		close(fd);
+		unlink(tmp_path);
+		return 0;
+	}
+	close(fd);
+
+	if (rename(tmp_path, path) != 0)
+	{
+		printf("Warning: Failed to rename %s to %s\n", tmp_path, path);
+		unlink(tmp_path);
+		return 0;
+	}
+
+	// Sync the directory too so the rename itself survives a crash
+	const char *slash = strrchr(path, '/');
+	if (slash)
+		snprintf(dir_path, sizeof(dir_path), "%.*s", (i32)(slash - path + 1), path);
+	else
+		snprintf(dir_path, sizeof(dir_path), ".");
+
+	fd = open(dir_path, O_RDONLY);
+	if (fd >= 0)
+	{
+		fsync(fd);
+		close(fd);
+	}
+
+	return 1;
+}
\ No newline at end of file
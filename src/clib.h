@@ -1,9 +1,15 @@
 #ifndef _CLIB_H_
 #define _CLIB_H_
 
+#include <pthread.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
 // Basic types
 typedef unsigned long long u64;
 typedef unsigned int u32;
+typedef unsigned char u8;
 typedef long long i64;
 typedef int i32;
 typedef double f64;
@@ -11,6 +17,7 @@ typedef float f32;
 
 _Static_assert (sizeof(u64) == 8, "u64 is not 8 bytes");
 _Static_assert (sizeof(u32) == 4, "u32 is not 4 bytes");
+_Static_assert (sizeof(u8) == 1, "u8 is not 1 byte");
 _Static_assert (sizeof(i64) == 8, "i64 is not 8 bytes");
 _Static_assert (sizeof(i32) == 4, "i32 is not 4 bytes");
 _Static_assert (sizeof(f64) == 8, "f64 is not 8 bytes");
@@ -26,14 +33,82 @@ _Static_assert (sizeof(f32) == 4, "f32 is not 4 bytes");
 typedef struct clib_arena_block
 {
 	void *next_block;
+	u64 block_size; // Blocks in a growing arena aren't all the same size
 } clib_arena_block;
 
-typedef struct clib_arena_freelist
+/*
+ * Every allocation is a chunk with an 8 byte header in front of it holding the
+ * chunk size and the flags below. Free chunks also store their size in their
+ * last 8 bytes (a boundary tag), so clib_arena_free can find and merge both
+ * neighbours in O(1). Each block ends with a size 0 header so the last chunk
+ * in a block has a next neighbour too.
+ *
+ * The bump allocator stays the fast path: freeing the chunk right before
+ * the end of the arena just moves current_index back.
+ *
+ * Chunk sizes are multiples of CLIB_ARENA_ALIGNMENT and every chunk starts a header
+ * before an aligned address, so plain allocations are max_align_t aligned with no padding.
+*/
+
+#define CLIB_ARENA_ALIGNMENT _Alignof(max_align_t)
+
+#define CLIB_ARENA_CHUNK_IN_USE 1ull
+#define CLIB_ARENA_CHUNK_PREV_IN_USE 2ull
+#define CLIB_ARENA_CHUNK_FLAGS 7ull
+#define CLIB_ARENA_CHUNK_HEADER_SIZE 8ull
+#define CLIB_ARENA_CHUNK_MIN_SIZE 32ull // Enough for a free chunk's header, links and boundary tag
+
+// Free chunks are kept in power of two size classes,
+// freelists[i] holds chunks with a size in [2^i, 2^(i+1))
+#define CLIB_ARENA_NUM_SIZE_CLASSES 64
+
+typedef struct clib_arena_chunk
 {
-	u64 size;
-	struct clib_arena_freelist *next;
-	struct clib_arena_freelist *prev;
-} clib_arena_freelist;
+	u64 header; // Size of the whole chunk | CLIB_ARENA_CHUNK_* flags
+
+	// Only valid while the chunk is free, allocations start here
+	struct clib_arena_chunk *next;
+	struct clib_arena_chunk *prev;
+} clib_arena_chunk;
+
+#ifdef CLIB_ARENA_TELEMETRY
+
+/*
+ * Build with -DCLIB_ARENA_TELEMETRY to have every arena record how it's used.
+ * Peaks are never rewound by scratch markers or resets, and allocations are
+ * counted per call site through the macros below.
+*/
+
+#define CLIB_ARENA_TELEMETRY_MAX_SITES 128 // Must be a power of two
+#define CLIB_ARENA_TELEMETRY_NUM_BUCKETS 32 // Bucket i counts allocations with a size in [2^i, 2^(i+1))
+
+typedef struct clib_arena_site
+{
+	const char *file; // NULL for allocations made inside clib
+	u32 line;
+	u64 num_allocations;
+	u64 total_size;
+	u64 histogram[CLIB_ARENA_TELEMETRY_NUM_BUCKETS];
+} clib_arena_site;
+
+typedef struct clib_arena_telemetry
+{
+	u64 peak_allocation_size;
+	u64 peak_num_allocations;
+	u64 peak_scratch_depth;
+	u64 block_size; // Bytes of blocks the arena holds right now, or bytes committed for virtual arenas
+	u64 peak_block_size;
+	u64 num_frees;
+
+	u64 tail_size; // Bytes left over at the end of retired blocks
+	u64 wasted_tail_size; // Part of tail_size that couldn't go on the freelist
+
+	u64 num_sites;
+	u64 num_dropped_sites; // Allocations from call sites that didn't fit in sites
+	clib_arena_site sites[CLIB_ARENA_TELEMETRY_MAX_SITES];
+} clib_arena_telemetry;
+
+#endif
 
 typedef struct clib_arena
 {
@@ -43,35 +118,154 @@ typedef struct clib_arena
 	clib_arena_block *current_block;
 	u64 current_index;
 
+	// Where the innermost open scratch marker was taken, scratch_block is NULL when none are open
 	clib_arena_block *scratch_block;
 	u64 scratch_index;
 	u64 scratch_total_allocation_size;
 	u64 scratch_num_allocations;
+	u64 scratch_depth;
 
-	clib_arena_freelist *freelist; // Freelist, ordered from biggest free block to smallest...
+	clib_arena_chunk *freelists[CLIB_ARENA_NUM_SIZE_CLASSES];
+	u64 freelist_bitmap; // Bit i is set when freelists[i] isn't empty
 
-	u64 block_size;
+	u64 block_size; // Size of the first block. For virtual arenas, the size of the whole reserved range
+	u64 max_block_size; // Blocks double in size up to this
+	u64 next_block_size; // Size of the next block that gets allocated
+	i32 is_virtual;
+	u64 committed_size; // Virtual arenas only, bytes from the start of the range that are readable and writable
 
 	u64 total_allocation_size;
 	u64 num_extra_blocks_allocated;
 	u64 num_allocations;
+
+#ifdef CLIB_ARENA_TELEMETRY
+	clib_arena_telemetry *telemetry; // Lives outside the arena so it doesn't eat into the first block
+#endif
 } clib_arena;
 
+/*
+ * Virtual arenas reserve reserve_size bytes of address space up front and commit
+ * pages as the arena grows, so they never need another block and memory stays contiguous.
+ * Any allocation that fits in the reservation is allowed, and reset gives the
+ * physical memory back to the OS.
+*/
+
+#define CLIB_ARENA_COMMIT_SIZE (64*1024) // Pages are committed this many bytes at a time
+
 clib_arena *clib_arena_init(u64 block_size);
+clib_arena *clib_arena_init_growing(u64 block_size, u64 max_block_size); // Each new block is twice the size of the last, up to max_block_size
+clib_arena *clib_arena_init_virtual(u64 reserve_size);
 void clib_arena_destroy(clib_arena **a); // Deallocates ALL blocks in arena and zeros it out. Sets arena ptr to NULL
 
 void* clib_arena_alloc(clib_arena *a, u64 size);
 void* clib_arena_calloc(clib_arena *a, u64 size); // Allocates AND zeroes the new memory
+void* clib_arena_alloc_aligned(clib_arena *a, u64 size, u64 align); // align must be a power of two
+
+// Gives an allocation back to the arena, merging it with free neighbours.
+// While a scratch marker is open, only memory allocated since the innermost marker is given back.
+void clib_arena_free(clib_arena *a, void *ptr);
 	
-void clib_arena_reset(clib_arena *a); // Sets arena back to beginning. Doesn't deallocate any blocks
-void clib_arena_shrink(clib_arena *a); // Deallocate all unused blocks, keeping ones with memory in! TODO: 
+void clib_arena_reset(clib_arena *a); // Sets arena back to beginning. Doesn't deallocate any blocks, virtual arenas release their pages
+void clib_arena_shrink(clib_arena *a); // Gives back every block past the current one, virtual arenas decommit the pages past the end
+
+/*
+ * Scratch markers save the end of the arena so everything allocated after
+ * can be thrown away at once. They nest, and must be restored in the reverse
+ * order they were taken:
+ *
+ *	clib_arena_marker scratch = clib_arena_mark(a);
+ *	void *temp = clib_arena_alloc(a, size);
+ *	...
+ *	clib_arena_restore(&scratch);
+*/
+
+typedef struct clib_arena_marker
+{
+	clib_arena *arena;
+	u64 depth;
+
+	// The arena's scratch state from before this marker was taken
+	clib_arena_block *prev_block;
+	u64 prev_index;
+	u64 prev_total_allocation_size;
+	u64 prev_num_allocations;
+} clib_arena_marker;
 
-void clib_arena_start_scratch(clib_arena *a);
-void clib_arena_stop_scratch(clib_arena *a);
+clib_arena_marker clib_arena_mark(clib_arena *a);
+void clib_arena_restore(clib_arena_marker *marker); // Frees everything allocated since the marker was taken
 
 void clib_arena_print_info(clib_arena *a);
 
-void _clib_arena_freelist_insert(clib_arena *a, clib_arena_freelist *f);
+#ifdef CLIB_ARENA_TELEMETRY
+
+void* clib_arena_alloc_site(clib_arena *a, u64 size, u64 align, const char *file, u32 line);
+void* clib_arena_calloc_site(clib_arena *a, u64 size, const char *file, u32 line);
+
+#define clib_arena_alloc(a, size) clib_arena_alloc_site(a, size, CLIB_ARENA_ALIGNMENT, __FILE__, __LINE__)
+#define clib_arena_calloc(a, size) clib_arena_calloc_site(a, size, __FILE__, __LINE__)
+#define clib_arena_alloc_aligned(a, size, align) clib_arena_alloc_site(a, size, align, __FILE__, __LINE__)
+
+// Writes the telemetry as a JSON object, along with the arena's totals and freelist fragmentation
+void clib_arena_telemetry_write_json(clib_arena *a, FILE *file);
+
+#endif
+
+/*
+ * Arena blocks come from a process wide pool instead of straight from malloc.
+ * Destroyed and shrunk arenas give their blocks back to it, so creating and destroying
+ * arenas of the same block size reuses memory. Once the pool holds CLIB_BLOCK_POOL_MAX_SIZE
+ * bytes, blocks are freed instead.
+*/
+
+#define CLIB_BLOCK_POOL_NUM_SIZES 8 // Different block sizes the pool keeps blocks for
+#define CLIB_BLOCK_POOL_MAX_SIZE (64*1024*1024)
+
+void *clib_block_pool_get(u64 block_size); // Never returns NULL
+void clib_block_pool_put(void *block, u64 block_size);
+void clib_block_pool_trim(); // Frees every block in the pool
+
+// ---------- Concurrent arenas ----------
+
+/*
+ * Bump allocator that any number of threads can allocate from at once.
+ * The bump index is advanced with an atomic fetch-add and full blocks are
+ * replaced with compare-and-swap, so nothing ever takes a lock. There's no
+ * free, and reset/destroy must only be called once every thread is done with it.
+ *
+ * A clib_concurrent_cache carves chunks off the shared arena for one thread
+ * so most of its allocations don't touch shared memory at all.
+*/
+
+#define CLIB_CONCURRENT_CHUNK_SIZE (16*1024) // Size of the chunks caches carve off the arena
+
+typedef struct clib_concurrent_block
+{
+	_Atomic(struct clib_concurrent_block*) next_block;
+	_Atomic u64 index; // Can go past the end of the block when threads race for the last bytes
+} clib_concurrent_block;
+
+typedef struct clib_concurrent_arena
+{
+	clib_concurrent_block *first_block;
+	_Atomic(clib_concurrent_block*) current_block;
+	u64 block_size;
+	_Atomic u64 num_blocks;
+} clib_concurrent_arena;
+
+typedef struct clib_concurrent_cache
+{
+	clib_concurrent_arena *arena;
+	u8 *current;
+	u8 *end;
+} clib_concurrent_cache;
+
+void clib_concurrent_arena_init(clib_concurrent_arena *a, u64 block_size);
+void clib_concurrent_arena_destroy(clib_concurrent_arena *a);
+void clib_concurrent_arena_reset(clib_concurrent_arena *a); // Not thread safe
+void *clib_concurrent_arena_alloc(clib_concurrent_arena *a, u64 size); // Thread safe, aligned to CLIB_ARENA_ALIGNMENT
+
+void clib_concurrent_cache_init(clib_concurrent_cache *cache, clib_concurrent_arena *a);
+void *clib_concurrent_cache_alloc(clib_concurrent_cache *cache, u64 size); // Only for the thread that owns cache
 
 // ---------- Vectors ----------
 
@@ -95,6 +289,59 @@ void *clib_vector_at(clib_vector *vector, u64 index);
 void clib_vector_push(clib_vector *vector, void *element);
 void clib_vector_pop(clib_vector *vector);
 
+// ---------- Thread scratch ----------
+
+/*
+ * Every thread gets its own virtual scratch arena the first time it asks for one,
+ * so worker threads can make temporaries without locks or malloc. It's destroyed
+ * when the thread exits. Take a marker before using it and restore it after, jobs
+ * run by clib_pool_run get the arena rewound for them once they return.
+*/
+
+#define CLIB_THREAD_SCRATCH_SIZE (1ull*1024*1024*1024) // Address space reserved per thread
+
+clib_arena *clib_thread_scratch();
+
+// ---------- Thread pool ----------
+
+typedef void (*clib_job_func)(void *data, u64 index);
+
+typedef struct clib_pool
+{
+	pthread_t *threads;
+	u64 num_threads;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	pthread_mutex_t run_mutex; // Only one batch runs at a time, other callers wait their turn
+
+	// Current batch
+	clib_job_func func;
+	void *data;
+	u64 num_jobs;
+	u64 next_job;
+	u64 num_done;
+
+	i32 quit;
+} clib_pool;
+
+u64 clib_num_cores();
+
+void clib_pool_init(clib_pool *pool, u64 num_threads); // num_threads = 0 uses one thread per core, counting the caller
+void clib_pool_destroy(clib_pool *pool);
+
+// Calls func(data, i) for every i < num_jobs across the pool and returns once they are all done.
+// Anything a job leaves in its thread's scratch arena is thrown away when it returns.
+// The calling thread works on the batch too. pool can be NULL to run everything on the caller.
+void clib_pool_run(clib_pool *pool, u64 num_jobs, clib_job_func func, void *data);
+
+// ---------- Checksums ----------
+
+// CRC32C (Castagnoli). Pass 0 to start, or a previous result to continue it.
+// Uses the SSE4.2 crc32 instruction when the CPU has it, a lookup table otherwise.
+u32 clib_crc32c(u32 crc, const void *data, u64 size);
+
 // ---------- Random numbers ----------
 // Adapted from https://www.pcg-random.org/, see full license at EOF
 
@@ -116,6 +363,10 @@ f32 clib_prng_rand_f32(clib_prng *rng);
 
 i32 clib_file_read(clib_arena *arena, const char *path, char **out_data, u64 *out_size);
 
+// Writes to path.tmp, fsyncs it and renames it over path, so readers only ever
+// see the old file or the complete new one
+i32 clib_file_write_atomic(const char *path, const void *data, u64 size);
+
 /*
  * PCG Random Number Generation for C.
  *
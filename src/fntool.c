@@ -0,0 +1,683 @@
+#include "note.h"
+#include "clib.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Headless tool for batch work on note files, links the note model but not GLFW/GL
+
+#define FN_TOOL_RESULT_SIZE 1024
+#define FN_TOOL_BENCH_PAGES 500
+#define FN_TOOL_BENCH_STROKES 50
+#define FN_TOOL_BENCH_POINTS 64
+#define FN_TOOL_BENCH_ITERATIONS 5
+#define FN_TOOL_BENCH_ARENA_BLOCK_SIZE (64*1024)
+#define FN_TOOL_BENCH_ARENA_ALLOCATIONS (2*1024*1024)
+#define FN_TOOL_BENCH_ARENA_LIVE 4096
+#define FN_TOOL_BENCH_CONCURRENT_BLOCK_SIZE (1024*1024)
+#define FN_TOOL_BENCH_CONCURRENT_ALLOCATIONS (4*1024*1024)
+
+typedef struct fn_tool_job
+{
+	char **paths;
+	char (*results)[FN_TOOL_RESULT_SIZE];
+	i32 *failed;
+
+	// convert
+	fn_file_format format;
+} fn_tool_job;
+
+static f64 fn_tool_time()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (f64)ts.tv_sec + (f64)ts.tv_nsec * 1e-9;
+}
+
+// Thread counts to benchmark, powers of two then every core
+static u64 fn_tool_next_num_threads(u64 num_threads, u64 num_cores)
+{
+	if (num_threads < num_cores && num_threads * 2 > num_cores)
+		return num_cores;
+	return num_threads * 2;
+}
+
+static void fn_tool_usage()
+{
+	printf("fn-tool %s\n", VERSION_STRING);
+	printf("usage:\n");
+	printf("\tfn-tool info <file>...\n");
+	printf("\tfn-tool validate <file>...\n");
+	printf("\tfn-tool convert <text|binary> <input> <output> [<input> <output>]...\n");
+	printf("\tfn-tool resample <file>...    how many points adaptive sampling would have stored\n");
+	printf("\tfn-tool bench [file]    benchmarks a synthetic %d page note without a file\n", FN_TOOL_BENCH_PAGES);
+	printf("\tfn-tool bench-arena    size class allocator against the sorted free list it replaced\n");
+	printf("\tfn-tool bench-concurrent\n");
+	printf("\tfn-tool arena-telemetry <file>    needs a CLIB_ARENA_TELEMETRY build\n");
+}
+
+static void fn_tool_info_job(void *data, u64 index)
+{
+	fn_tool_job *job = data;
+	char *result = job->results[index];
+	const char *path = job->paths[index];
+
+	fn_note note;
+	if (!fn_note_read_file(&note, path))
+	{
+		snprintf(result, FN_TOOL_RESULT_SIZE, "%s: failed to read\n", path);
+		job->failed[index] = 1;
+		return;
+	}
+
+	// Decoding every page verifies their checksums and gives real arena usage
+	fn_note_materialise_all(&note, NULL);
+
+	fn_note_stats stats;
+	fn_note_get_stats(&note, &stats);
+
+	snprintf(result, FN_TOOL_RESULT_SIZE,
+			"%s: %s\n"
+			"\t%llu page(s), %llu damaged\n"
+			"\t%llu stroke(s)\n"
+			"\t%llu point(s)\n"
+			"\t%llu bytes of page data\n"
+			"\t%llu bytes of note data\n",
+			path, note.mapping ? "binary" : "text",
+			stats.num_pages, stats.num_damaged_pages,
+			stats.num_strokes,
+			stats.num_points,
+			stats.page_data_size,
+			note.mem->total_allocation_size);
+
+	fn_note_destroy(&note);
+}
+
+static void fn_tool_validate_job(void *data, u64 index)
+{
+	fn_tool_job *job = data;
+	char *result = job->results[index];
+	const char *path = job->paths[index];
+	u64 result_size = 0;
+
+	fn_note note;
+	if (!fn_note_read_file(&note, path))
+	{
+		snprintf(result, FN_TOOL_RESULT_SIZE, "%s: FAILED, not a readable note\n", path);
+		job->failed[index] = 1;
+		return;
+	}
+
+	if (note.mapping == NULL)
+	{
+		snprintf(result, FN_TOOL_RESULT_SIZE, "%s: OK, text notes have no checksums\n", path);
+		fn_note_destroy(&note);
+		return;
+	}
+
+	// Checks the mapped chunks directly, nothing is decoded
+	u64 num_damaged = 0;
+	for (u64 i = 0; i < note.num_pages; i++)
+	{
+		fn_page *page = note.pages[i];
+		if (page->damaged || (page->mapped && !fn_file_page_verify(page->mapped, page->mapped_data)))
+		{
+			if (num_damaged == 0)
+				result_size += snprintf(result + result_size, FN_TOOL_RESULT_SIZE - result_size, "%s: FAILED, damaged page(s):", path);
+			if (result_size < FN_TOOL_RESULT_SIZE)
+				result_size += snprintf(result + result_size, FN_TOOL_RESULT_SIZE - result_size, " %llu", page->page_number);
+			num_damaged++;
+		}
+	}
+
+	if (num_damaged > 0)
+	{
+		if (result_size < FN_TOOL_RESULT_SIZE)
+			snprintf(result + result_size, FN_TOOL_RESULT_SIZE - result_size, "\n");
+		job->failed[index] = 1;
+	}
+	else
+		snprintf(result, FN_TOOL_RESULT_SIZE, "%s: OK\n", path);
+
+	fn_note_destroy(&note);
+}
+
+static void fn_tool_convert_job(void *data, u64 index)
+{
+	fn_tool_job *job = data;
+	char *result = job->results[index];
+	const char *input = job->paths[index * 2];
+	const char *output = job->paths[index * 2 + 1];
+
+	fn_note note;
+	if (!fn_note_read_file(&note, input))
+	{
+		snprintf(result, FN_TOOL_RESULT_SIZE, "%s: failed to read\n", input);
+		job->failed[index] = 1;
+		return;
+	}
+
+	if (fn_note_write_file(&note, clib_thread_scratch(), NULL, output, job->format))
+		snprintf(result, FN_TOOL_RESULT_SIZE, "%s -> %s\n", input, output);
+	else
+	{
+		snprintf(result, FN_TOOL_RESULT_SIZE, "%s: failed to write %s\n", input, output);
+		job->failed[index] = 1;
+	}
+
+	fn_note_destroy(&note);
+}
+
+// Replays every stroke through the input sampler to see how much less it would have stored
+static void fn_tool_resample_job(void *data, u64 index)
+{
+	fn_tool_job *job = data;
+	char *result = job->results[index];
+	const char *path = job->paths[index];
+
+	fn_note note;
+	if (!fn_note_read_file(&note, path))
+	{
+		snprintf(result, FN_TOOL_RESULT_SIZE, "%s: failed to read\n", path);
+		job->failed[index] = 1;
+		return;
+	}
+
+	u64 num_points = 0;
+	u64 num_kept = 0;
+	for (u64 i = 0; i < note.num_pages; i++)
+	{
+		fn_page *page = note.pages[i];
+		fn_page_materialise(page);
+
+		for (u64 j = 0; j < page->num_strokes; j++)
+		{
+			fn_stroke *stroke = &page->strokes[j];
+			fn_sampler sampler;
+			fn_sampler_begin(&sampler);
+
+			fn_point out[2];
+			for (u64 k = stroke->first_point; k < stroke->first_point + stroke->num_points; k++)
+			{
+				num_kept += fn_sampler_add(&sampler, (fn_point){
+					.pos = (v2){page->points.x[k], page->points.y[k]},
+					.t = page->points.t[k],
+					.pressure = page->points.pressure[k],
+				}, out);
+			}
+			num_kept += fn_sampler_end(&sampler, out);
+			num_points += stroke->num_points;
+		}
+	}
+
+	// Every point is four floats in the file, the stroke table doesn't change
+	snprintf(result, FN_TOOL_RESULT_SIZE,
+			"%s: %llu -> %llu point(s), %llu -> %llu bytes of point data (%.1f%% smaller)\n",
+			path, num_points, num_kept,
+			num_points * sizeof(fn_point), num_kept * sizeof(fn_point),
+			num_points > 0 ? 100.0 * (f64)(num_points - num_kept) / (f64)num_points : 0.0);
+
+	fn_note_destroy(&note);
+}
+
+// Runs one job per file across every core and prints the results in order
+static i32 fn_tool_run(u64 num_jobs, clib_job_func func, fn_tool_job *job)
+{
+	job->results = calloc(num_jobs, FN_TOOL_RESULT_SIZE);
+	job->failed = calloc(num_jobs, sizeof(i32));
+	CLIB_ASSERT(job->results && job->failed, "calloc failed");
+
+	// Per file warnings from the note model go straight to stdout, results come after
+	clib_pool pool;
+	clib_pool_init(&pool, 0);
+	clib_pool_run(&pool, num_jobs, func, job);
+	clib_pool_destroy(&pool);
+
+	i32 num_failed = 0;
+	for (u64 i = 0; i < num_jobs; i++)
+	{
+		printf("%s", job->results[i]);
+		num_failed += job->failed[i];
+	}
+
+	free(job->results);
+	free(job->failed);
+	return num_failed == 0 ? 0 : 1;
+}
+
+static void fn_tool_generate_note(fn_note *note)
+{
+	clib_prng rng;
+	clib_prng_init_seed(&rng, 42, 54);
+
+	fn_note_init_empty(note);
+	for (u64 i = 0; i < FN_TOOL_BENCH_PAGES; i++)
+	{
+		fn_page *page = fn_note_append_page(note);
+
+		for (u64 j = 0; j < FN_TOOL_BENCH_STROKES; j++)
+		{
+			fn_page_begin_stroke(page);
+
+			// Random walk across the page
+			v2 pos = {clib_prng_rand_f32(&rng) * page->size.x, clib_prng_rand_f32(&rng) * page->size.y};
+			for (u64 k = 0; k < FN_TOOL_BENCH_POINTS; k++)
+			{
+				fn_page_add_point(page, (fn_point){ .pos = pos, .t = k * 0.01f, .pressure = 1.0f });
+
+				pos.x += clib_prng_rand_f32(&rng) * 4.0f - 2.0f;
+				pos.y += clib_prng_rand_f32(&rng) * 4.0f - 2.0f;
+			}
+		}
+	}
+}
+
+static i32 fn_tool_bench(const char *path)
+{
+	fn_note note;
+	if (path)
+	{
+		if (!fn_note_read_file(&note, path)) return 1;
+		fn_note_materialise_all(&note, NULL);
+	}
+	else
+		fn_tool_generate_note(&note);
+
+	fn_note_stats stats;
+	fn_note_get_stats(&note, &stats);
+	printf("%llu page(s), %llu stroke(s), %llu point(s)\n", stats.num_pages, stats.num_strokes, stats.num_points);
+
+	clib_arena *scratch = clib_arena_init_virtual(FN_SAVER_ARENA_SIZE);
+	fn_note_snapshot snapshot;
+	fn_note_snapshot_take(&snapshot, scratch, &note);
+
+	// Decoding is measured from a real file so it includes mapping it
+	char decode_path[] = "/tmp/fn-tool-bench-XXXXXX";
+	i32 fd = mkstemp(decode_path);
+	CLIB_ASSERT(fd >= 0, "Failed to create temporary file");
+	close(fd);
+	CLIB_ASSERT(fn_note_snapshot_write_file(&snapshot, NULL, decode_path, FN_FILE_BINARY), "Failed to write temporary file");
+
+	u64 num_cores = clib_num_cores();
+	printf("%8s %16s %16s %16s\n", "threads", "encode bin MB/s", "encode text MB/s", "decode bin MB/s");
+
+	for (u64 num_threads = 1; num_threads <= num_cores; num_threads = fn_tool_next_num_threads(num_threads, num_cores))
+	{
+		clib_pool pool;
+		clib_pool_init(&pool, num_threads);
+
+		f64 results[3] = {0};
+		fn_file_format formats[2] = {FN_FILE_BINARY, FN_FILE_TEXT};
+		for (u64 i = 0; i < 2; i++)
+		{
+			u64 bytes = 0;
+			f64 start = fn_tool_time();
+			for (u64 j = 0; j < FN_TOOL_BENCH_ITERATIONS; j++)
+			{
+				clib_vector buffer = {0};
+				fn_note_snapshot_encode(&snapshot, &pool, formats[i], &buffer);
+				bytes += buffer.count;
+				clib_vector_destroy(&buffer);
+			}
+			results[i] = bytes / (fn_tool_time() - start) / (1024.0 * 1024.0);
+		}
+
+		u64 bytes = 0;
+		f64 start = fn_tool_time();
+		for (u64 j = 0; j < FN_TOOL_BENCH_ITERATIONS; j++)
+		{
+			fn_note decoded;
+			CLIB_ASSERT(fn_note_read_file(&decoded, decode_path), "Failed to read temporary file");
+			fn_note_materialise_all(&decoded, &pool);
+			bytes += decoded.mapping_size;
+			fn_note_destroy(&decoded);
+		}
+		results[2] = bytes / (fn_tool_time() - start) / (1024.0 * 1024.0);
+
+		printf("%8llu %16.1f %16.1f %16.1f\n", num_threads, results[0], results[1], results[2]);
+
+		clib_pool_destroy(&pool);
+	}
+
+	unlink(decode_path);
+	fn_note_unpin(&note);
+	clib_arena_destroy(&scratch);
+	fn_note_destroy(&note);
+	return 0;
+}
+
+// clib_arena's allocator from before its free space was kept in size classes (4fdad3a), so
+// bench-arena can time both. Free regions only come from the tails of blocks and sit in one list,
+// biggest first, walked for the first that fits. Kept as it was, including the insert that only
+// ever compares against the head and cuts off the rest of the list when it goes behind it.
+typedef struct fn_tool_linear_free
+{
+	u64 size;
+	struct fn_tool_linear_free *next;
+	struct fn_tool_linear_free *prev;
+} fn_tool_linear_free;
+
+typedef struct fn_tool_linear_arena
+{
+	void *block; // Blocks are linked through their first bytes
+	u64 index;
+	fn_tool_linear_free *freelist;
+} fn_tool_linear_arena;
+
+static void fn_tool_linear_insert(fn_tool_linear_arena *a, fn_tool_linear_free *f)
+{
+	f->next = NULL;
+	f->prev = NULL;
+
+	fn_tool_linear_free *current = a->freelist;
+	if (current == NULL)
+	{
+		a->freelist = f;
+		return;
+	}
+
+	if (f->size > current->size)
+	{
+		a->freelist = f;
+		f->next = current;
+		return;
+	}
+
+	current->next = f;
+	f->prev = current;
+}
+
+static void *fn_tool_linear_alloc(fn_tool_linear_arena *a, u64 size)
+{
+	for (fn_tool_linear_free *f = a->freelist; f != NULL; f = f->next)
+	{
+		if (size > f->size) continue;
+
+		if (size + sizeof(fn_tool_linear_free) <= f->size)
+		{
+			f->size -= size;
+			return (u8*)f + f->size;
+		}
+
+		if (f->prev)
+			f->prev->next = f->next;
+		else
+			a->freelist = f->next;
+		if (f->next)
+			f->next->prev = f->prev;
+		return f;
+	}
+
+	if (a->block == NULL || a->index + size > FN_TOOL_BENCH_ARENA_BLOCK_SIZE)
+	{
+		u64 wasted_space = FN_TOOL_BENCH_ARENA_BLOCK_SIZE - a->index;
+		if (a->block != NULL && wasted_space > sizeof(fn_tool_linear_free))
+		{
+			fn_tool_linear_free *tail = (fn_tool_linear_free*)((u8*)a->block + a->index);
+			tail->size = wasted_space;
+			fn_tool_linear_insert(a, tail);
+		}
+
+		void *block = malloc(FN_TOOL_BENCH_ARENA_BLOCK_SIZE);
+		CLIB_ASSERT(block, "malloc failed");
+		*(void**)block = a->block;
+		a->block = block;
+		a->index = sizeof(void*);
+	}
+
+	void *ptr = (u8*)a->block + a->index;
+	a->index += size;
+	return ptr;
+}
+
+static void fn_tool_linear_destroy(fn_tool_linear_arena *a)
+{
+	while (a->block != NULL)
+	{
+		void *next = *(void**)a->block;
+		free(a->block);
+		a->block = next;
+	}
+}
+
+// Mostly small allocations with the odd big one, so blocks end early
+// and the small allocations are served from lots of free block tails
+static i32 fn_tool_bench_arena()
+{
+	clib_prng rng;
+	clib_prng_init_seed(&rng, 42, 54);
+
+	u32 *sizes = malloc(FN_TOOL_BENCH_ARENA_ALLOCATIONS * sizeof(u32));
+	CLIB_ASSERT(sizes, "malloc failed");
+	for (u64 i = 0; i < FN_TOOL_BENCH_ARENA_ALLOCATIONS; i++)
+	{
+		if (clib_prng_rand_u32_range(&rng, 0, 99) < 2)
+			sizes[i] = clib_prng_rand_u32_range(&rng, 2048, 16384);
+		else
+			sizes[i] = clib_prng_rand_u32_range(&rng, 8, 128);
+	}
+
+	clib_arena *a = clib_arena_init(FN_TOOL_BENCH_ARENA_BLOCK_SIZE);
+
+	// Every allocation is written to like a caller would, so both allocators pay for touching their pages
+	f64 start = fn_tool_time();
+	for (u64 i = 0; i < FN_TOOL_BENCH_ARENA_ALLOCATIONS; i++)
+		*(u8*)clib_arena_alloc(a, sizes[i]) = 0;
+	f64 elapsed = fn_tool_time() - start;
+
+	printf("%d allocation(s) in %.3f s, %.1f ns per allocation\n", FN_TOOL_BENCH_ARENA_ALLOCATIONS, elapsed, elapsed * 1e9 / FN_TOOL_BENCH_ARENA_ALLOCATIONS);
+	clib_arena_print_info(a);
+
+	// The same allocations with the sorted free list, it had no free so only this part compares
+	fn_tool_linear_arena linear = {0};
+	start = fn_tool_time();
+	for (u64 i = 0; i < FN_TOOL_BENCH_ARENA_ALLOCATIONS; i++)
+		*(u8*)fn_tool_linear_alloc(&linear, sizes[i]) = 0;
+	elapsed = fn_tool_time() - start;
+
+	printf("Sorted free list (before 4fdad3a): %d allocation(s) in %.3f s, %.1f ns per allocation\n", FN_TOOL_BENCH_ARENA_ALLOCATIONS, elapsed, elapsed * 1e9 / FN_TOOL_BENCH_ARENA_ALLOCATIONS);
+	fn_tool_linear_destroy(&linear);
+
+	// Erase and redraw, a fixed amount of memory is live at once
+	// so the arena shouldn't keep growing
+	clib_arena_destroy(&a);
+	a = clib_arena_init(FN_TOOL_BENCH_ARENA_BLOCK_SIZE);
+	void **live = calloc(FN_TOOL_BENCH_ARENA_LIVE, sizeof(void*));
+	CLIB_ASSERT(live, "calloc failed");
+
+	start = fn_tool_time();
+	for (u64 i = 0; i < FN_TOOL_BENCH_ARENA_ALLOCATIONS; i++)
+	{
+		u64 slot = clib_prng_rand_u32_range(&rng, 0, FN_TOOL_BENCH_ARENA_LIVE - 1);
+		clib_arena_free(a, live[slot]);
+		live[slot] = clib_arena_alloc(a, sizes[i]);
+	}
+	elapsed = fn_tool_time() - start;
+
+	printf("%d free/allocation pair(s) with %d live in %.3f s, %.1f ns per pair\n", FN_TOOL_BENCH_ARENA_ALLOCATIONS, FN_TOOL_BENCH_ARENA_LIVE, elapsed, elapsed * 1e9 / FN_TOOL_BENCH_ARENA_ALLOCATIONS);
+	clib_arena_print_info(a);
+
+	clib_arena_destroy(&a);
+	free(live);
+	free(sizes);
+	return 0;
+}
+
+typedef enum fn_tool_alloc_mode
+{
+	FN_TOOL_ALLOC_MUTEX, // clib_arena_alloc behind a mutex
+	FN_TOOL_ALLOC_ATOMIC, // clib_concurrent_arena_alloc
+	FN_TOOL_ALLOC_CACHE, // clib_concurrent_cache_alloc
+	FN_TOOL_NUM_ALLOC_MODES
+} fn_tool_alloc_mode;
+
+typedef struct fn_tool_alloc_job
+{
+	fn_tool_alloc_mode mode;
+	u64 num_jobs;
+	u32 *sizes;
+
+	clib_arena *arena;
+	pthread_mutex_t mutex;
+	clib_concurrent_arena concurrent;
+} fn_tool_alloc_job;
+
+static void fn_tool_alloc_job_run(void *data, u64 index)
+{
+	fn_tool_alloc_job *job = data;
+	u64 first = FN_TOOL_BENCH_CONCURRENT_ALLOCATIONS * index / job->num_jobs;
+	u64 last = FN_TOOL_BENCH_CONCURRENT_ALLOCATIONS * (index + 1) / job->num_jobs;
+
+	switch (job->mode)
+	{
+		case FN_TOOL_ALLOC_MUTEX:
+			for (u64 i = first; i < last; i++)
+			{
+				pthread_mutex_lock(&job->mutex);
+				clib_arena_alloc(job->arena, job->sizes[i]);
+				pthread_mutex_unlock(&job->mutex);
+			}
+			break;
+		case FN_TOOL_ALLOC_ATOMIC:
+			for (u64 i = first; i < last; i++)
+				clib_concurrent_arena_alloc(&job->concurrent, job->sizes[i]);
+			break;
+		case FN_TOOL_ALLOC_CACHE:
+		{
+			clib_concurrent_cache cache;
+			clib_concurrent_cache_init(&cache, &job->concurrent);
+			for (u64 i = first; i < last; i++)
+				clib_concurrent_cache_alloc(&cache, job->sizes[i]);
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+// Every thread hammers one shared arena with small allocations
+static i32 fn_tool_bench_concurrent()
+{
+	clib_prng rng;
+	clib_prng_init_seed(&rng, 42, 54);
+
+	fn_tool_alloc_job job = {0};
+	job.sizes = malloc(FN_TOOL_BENCH_CONCURRENT_ALLOCATIONS * sizeof(u32));
+	CLIB_ASSERT(job.sizes, "malloc failed");
+	for (u64 i = 0; i < FN_TOOL_BENCH_CONCURRENT_ALLOCATIONS; i++)
+		job.sizes[i] = clib_prng_rand_u32_range(&rng, 8, 128);
+	CLIB_ASSERT(pthread_mutex_init(&job.mutex, NULL) == 0, "Failed to create mutex");
+
+	printf("%d allocation(s) per run\n", FN_TOOL_BENCH_CONCURRENT_ALLOCATIONS);
+	printf("%8s %16s %16s %16s\n", "threads", "mutex Mallocs/s", "atomic Mallocs/s", "cache Mallocs/s");
+
+	u64 num_cores = clib_num_cores();
+	for (u64 num_threads = 1; num_threads <= num_cores; num_threads = fn_tool_next_num_threads(num_threads, num_cores))
+	{
+		clib_pool pool;
+		clib_pool_init(&pool, num_threads);
+		job.num_jobs = num_threads;
+
+		f64 results[FN_TOOL_NUM_ALLOC_MODES];
+		for (u64 mode = 0; mode < FN_TOOL_NUM_ALLOC_MODES; mode++)
+		{
+			job.mode = mode;
+			job.arena = clib_arena_init(FN_TOOL_BENCH_CONCURRENT_BLOCK_SIZE);
+			clib_concurrent_arena_init(&job.concurrent, FN_TOOL_BENCH_CONCURRENT_BLOCK_SIZE);
+
+			f64 start = fn_tool_time();
+			clib_pool_run(&pool, num_threads, fn_tool_alloc_job_run, &job);
+			results[mode] = FN_TOOL_BENCH_CONCURRENT_ALLOCATIONS / (fn_tool_time() - start) / 1e6;
+
+			clib_concurrent_arena_destroy(&job.concurrent);
+			clib_arena_destroy(&job.arena);
+		}
+
+		printf("%8llu %16.1f %16.1f %16.1f\n", num_threads, results[0], results[1], results[2]);
+		clib_pool_destroy(&pool);
+	}
+
+	pthread_mutex_destroy(&job.mutex);
+	free(job.sizes);
+	return 0;
+}
+
+// Loads every page and writes what their arenas went through as JSON
+static i32 fn_tool_arena_telemetry(const char *path)
+{
+#ifdef CLIB_ARENA_TELEMETRY
+	fn_note note;
+	if (!fn_note_read_file(&note, path))
+	{
+		printf("%s: failed to read\n", path);
+		return 1;
+	}
+
+	fn_note_materialise_all(&note, NULL);
+	fn_note_write_arena_telemetry(&note, stdout);
+	printf("\n");
+
+	fn_note_destroy(&note);
+	return 0;
+#else
+	(void)path;
+	printf("fn-tool was built without CLIB_ARENA_TELEMETRY\n");
+	return 1;
+#endif
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		fn_tool_usage();
+		return 1;
+	}
+
+	const char *command = argv[1];
+	fn_tool_job job = { .paths = argv + 2 };
+	u64 num_paths = argc - 2;
+
+	if (strcmp(command, "info") == 0 && num_paths > 0)
+		return fn_tool_run(num_paths, fn_tool_info_job, &job);
+
+	if (strcmp(command, "validate") == 0 && num_paths > 0)
+		return fn_tool_run(num_paths, fn_tool_validate_job, &job);
+
+	if (strcmp(command, "convert") == 0 && num_paths >= 3 && num_paths % 2 == 1)
+	{
+		if (strcmp(argv[2], "text") == 0)
+			job.format = FN_FILE_TEXT;
+		else if (strcmp(argv[2], "binary") == 0)
+			job.format = FN_FILE_BINARY;
+		else
+		{
+			fn_tool_usage();
+			return 1;
+		}
+
+		job.paths = argv + 3;
+		return fn_tool_run((num_paths - 1) / 2, fn_tool_convert_job, &job);
+	}
+
+	if (strcmp(command, "resample") == 0 && num_paths > 0)
+		return fn_tool_run(num_paths, fn_tool_resample_job, &job);
+
+	if (strcmp(command, "bench") == 0 && num_paths <= 1)
+		return fn_tool_bench(num_paths == 1 ? argv[2] : NULL);
+
+	if (strcmp(command, "bench-arena") == 0 && num_paths == 0)
+		return fn_tool_bench_arena();
+
+	if (strcmp(command, "bench-concurrent") == 0 && num_paths == 0)
+		return fn_tool_bench_concurrent();
+
+	if (strcmp(command, "arena-telemetry") == 0 && num_paths == 1)
+		return fn_tool_arena_telemetry(argv[2]);
+
+	fn_tool_usage();
+	return 1;
+}
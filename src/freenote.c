@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <math.h>
 
 static float square_vertices[] = {
 	0.0f, 0.0f,
@@ -30,16 +31,9 @@ int main()
 		// Update time
 		app.time = (f32)glfwGetTime();
 
-		// Track mouse position in window
-		{
-			double x,y;
-			glfwGetCursorPos(app.window, &x, &y);
-			app.mouse_screen.x = (f32)x;
-			app.mouse_screen.y = (f32)y;
-			app.mouse_canvas = fn_pixel_to_point(app.mouse_screen, app.current_note->viewport, app.framebuffer_size, app.current_note->DPI);
-		}
-
 		fn_process_input(&app);
+		fn_app_update_save(&app);
+		fn_saver_release(&app.saver);
 
 		// Prepare for rendering
 		glViewport(0, 0, app.framebuffer_width, app.framebuffer_height);
@@ -52,11 +46,42 @@ int main()
         glfwPollEvents();
     }
 
+	// Don't drop a save the user asked for while another was in flight
+	if (app.save_pending)
+	{
+		fn_saver_wait(&app.saver);
+		fn_app_save(&app);
+	}
+	fn_saver_destroy(&app.saver);
+	clib_pool_destroy(&app.pool);
+	clib_vector_destroy(&app.lasso);
+	clib_vector_destroy(&app.selection);
+
 	glfwDestroyWindow(app.window);
     glfwTerminate();
     return 0;
 }
 
+static void fn_canvas_set_model(fn_app_state *app, fn_affine transform)
+{
+	// Column major
+	f32 matrix[9] = {
+		transform.a, transform.b, 0.0f,
+		transform.c, transform.d, 0.0f,
+		transform.tx, transform.ty, 1.0f,
+	};
+	glUniformMatrix3fv(app->canvas_shader.model, 1, GL_FALSE, matrix);
+}
+
+static void fn_canvas_draw_lines(fn_app_state *app, GLenum mode, const v2 *points, u64 num_points)
+{
+	glBindBuffer(GL_ARRAY_BUFFER, app->stroke_buffer);
+	glBufferData(GL_ARRAY_BUFFER, num_points * sizeof(v2), points, GL_DYNAMIC_DRAW);
+	glVertexAttribPointer(0, 1, GL_FLOAT, GL_FALSE, sizeof(v2), (void*)0);
+	glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(v2), (void*)sizeof(f32));
+	glDrawArrays(mode, 0, (GLsizei)num_points);
+}
+
 // TODO: Use depth testing...
 void fn_note_draw(fn_app_state *app, fn_note *note)
 {
@@ -77,127 +102,165 @@ void fn_note_draw(fn_app_state *app, fn_note *note)
 			framebuffer_height_points
 	);
 	glUniform2f(app->canvas_shader.translate, 0.0f, 0.0f);
+	fn_canvas_set_model(app, FN_AFFINE_IDENTITY);
+
+	f32 view_left = note->viewport.x;
+	f32 view_top = note->viewport.y;
+	f32 view_right = note->viewport.x + framebuffer_width_points;
+	f32 view_bottom = note->viewport.y + framebuffer_height_points;
 
-	fn_page *page = note->first_page;
-	while (page != NULL)
+	// Only the pages in the viewport are visited, so pages of a mapped file are only decoded once seen
+	fn_page *first_visible = fn_page_at_point(note, (v2){view_left, view_top});
+	for (u64 i = first_visible->page_number; i < note->num_pages; i++)
 	{
+		fn_page *page = note->pages[i];
+		v2 position = fn_note_page_position(note, i);
+		if (position.y > view_bottom) break;
+		if (position.x > view_right || position.x + page->size.x < view_left ||
+				position.y + page->size.y < view_top)
+			continue;
+
+		fn_page_materialise(page);
+
 		// Draw a white rectangle to represent the page
 		glBindBuffer(GL_ARRAY_BUFFER, app->square_buffer);
-		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), 0);
+		glVertexAttribPointer(0, 1, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+		glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)sizeof(float));
 		glEnableVertexAttribArray(0);
+		glEnableVertexAttribArray(1);
 		glUniform4f(app->canvas_shader.colour, 1.0f, 1.0f, 1.0f, 1.0f);
-		glUniform2f(app->canvas_shader.scale, note->page_size.x, note->page_size.y);
-		glUniform2f(app->canvas_shader.translate, page->position.x, page->position.y);
+		glUniform2f(app->canvas_shader.scale, page->size.x, page->size.y);
+		glUniform2f(app->canvas_shader.translate, position.x, position.y);
 		glDrawArrays(GL_TRIANGLES, 0, 6);
 
-		// Render each stroke separately for now...
+		if (page->num_strokes == 0)
+			continue;
+
+		// The x and y columns are uploaded as they are and every stroke is drawn in one call
+		u64 column_size = page->num_points * sizeof(f32);
+		glBindBuffer(GL_ARRAY_BUFFER, app->stroke_buffer);
+		glBufferData(GL_ARRAY_BUFFER, column_size * 2, NULL, GL_DYNAMIC_DRAW);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, column_size, page->points.x);
+		glBufferSubData(GL_ARRAY_BUFFER, column_size, column_size, page->points.y);
+		glVertexAttribPointer(0, 1, GL_FLOAT, GL_FALSE, sizeof(f32), (void*)0);
+		glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(f32), (void*)column_size);
+
+		clib_arena_marker scratch = clib_arena_mark(app->mem);
+		GLint *firsts = clib_arena_alloc(app->mem, page->num_strokes * sizeof(GLint));
+		GLsizei *counts = clib_arena_alloc(app->mem, page->num_strokes * sizeof(GLsizei));
+
+		// Selected strokes are left out here and drawn with the selection's transform below
+		u8 *selected = NULL;
+		if (page == app->selection_page && app->selection.count > 0)
+		{
+			selected = clib_arena_calloc(app->mem, page->num_strokes);
+			u32 *strokes = app->selection.data;
+			for (u64 i = 0; i < app->selection.count; i++)
+				selected[strokes[i]] = 1;
+		}
 
-		fn_stroke *stroke = page->first_stroke;
-		while (stroke != NULL)
+		u64 num_drawn = 0;
+		for (u64 i = 0; i < page->num_strokes; i++)
 		{
-			// Collect points from stroke segments into a buffer
-			clib_arena_start_scratch(app->mem);
-			v2 *points = clib_arena_alloc(app->mem, 1024*1024);
-			u64 num_points = 0;
+			if (page->strokes[i].hidden || (selected && selected[i])) continue;
+			firsts[num_drawn] = (GLint)page->strokes[i].first_point;
+			counts[num_drawn] = (GLsizei)page->strokes[i].num_points;
+			num_drawn++;
+		}
+
+		glUniform4f(app->canvas_shader.colour, 0.0f, 0.0f, 0.0f, 1.0f);
+		glUniform2f(app->canvas_shader.scale, 1.0f, 1.0f);
+		glUniform2f(app->canvas_shader.translate, position.x, position.y);
+		glLineWidth(5.0f);
+		glMultiDrawArrays(GL_LINE_STRIP, firsts, counts, (GLsizei)num_drawn);
 
-			fn_segment *segment = &stroke->first_segment;
-			while (segment != NULL)
+		if (selected)
+		{
+			u32 *strokes = app->selection.data;
+			for (u64 i = 0; i < app->selection.count; i++)
 			{
-				CLIB_ASSERT(num_points + segment->num_points <= 1024*1024, "Out of room in buffer!");
-				for (u64 i = 0; i < segment->num_points; i++)
-				{
-					points[num_points] = segment->points[i].pos;
-					num_points++;
-				}
-
-				segment = segment->next;
+				firsts[i] = (GLint)page->strokes[strokes[i]].first_point;
+				counts[i] = (GLsizei)page->strokes[strokes[i]].num_points;
 			}
 
-			// Render the stroke
-			
-			glBindBuffer(GL_ARRAY_BUFFER, app->stroke_buffer);
-			glBufferData(GL_ARRAY_BUFFER, num_points * sizeof(v2), points, GL_DYNAMIC_DRAW);
-			glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(v2), 0);
-			glEnableVertexAttribArray(0);
-
-			glUniform4f(app->canvas_shader.colour, 0.0f, 0.0f, 0.0f, 1.0f);
-			glUniform2f(app->canvas_shader.scale, 1.0f, 1.0f);
-			glUniform2f(app->canvas_shader.transform, page->position.x, page->position.y);
-			glLineWidth(5.0f);
-			glDrawArrays(GL_LINE_STRIP, 0, num_points);
-			
-			stroke = stroke->next;
-
-			clib_arena_stop_scratch(app->mem);
+			glUniform4f(app->canvas_shader.colour, 0.1f, 0.3f, 0.8f, 1.0f);
+			fn_canvas_set_model(app, app->selection_transform);
+			glMultiDrawArrays(GL_LINE_STRIP, firsts, counts, (GLsizei)app->selection.count);
+			fn_canvas_set_model(app, FN_AFFINE_IDENTITY);
 		}
 
-		page = page->next;
+		clib_arena_restore(&scratch);
 	}
-}
 
-void fn_note_write_file(fn_app_state *app, fn_note *note, const char *path)
-{
-	clib_arena_start_scratch(app->mem);
+	// The lasso and the selection's outline go over every page
+	glUniform4f(app->canvas_shader.colour, 0.1f, 0.3f, 0.8f, 1.0f);
+	glUniform2f(app->canvas_shader.scale, 1.0f, 1.0f);
+	glLineWidth(2.0f);
 
-	u64 buffer_capacity = 1024*1024;
-	u64 buffer_count = 0;
-	char *buffer = clib_arena_alloc(app->mem, buffer_capacity);
-
-	u64 ret = snprintf(buffer + buffer_count, buffer_capacity - buffer_count, "v %d %d %d\n", VERSION_MAJOR, VERSION_MINOR, VERSION_REVISION);
-	CLIB_ASSERT(ret < (buffer_capacity - buffer_count), "Out of space in buffer");
-	buffer_count += ret;
-
-	fn_page *page = note->first_page;
-	while (page != NULL)
+	if (app->lasso_page && app->lasso.count >= 2)
 	{
-		u64 ret = snprintf(buffer + buffer_count, buffer_capacity - buffer_count, "p %llu\n", page->page_number);
-		CLIB_ASSERT(ret < (buffer_capacity - buffer_count), "Out of space in buffer");
-		buffer_count += ret;
-
-		fn_stroke *stroke = page->first_stroke;
-		while (stroke != NULL)
-		{
-			u64 ret = snprintf(buffer + buffer_count, buffer_capacity - buffer_count, "s\n");
-			CLIB_ASSERT(ret < (buffer_capacity - buffer_count), "Out of space in buffer");
-			buffer_count += ret;
-
-			fn_segment *segment = &stroke->first_segment;
-			while (segment != NULL)
-			{
-				for (u64 i = 0; i < segment->num_points; i++)
-				{
-					fn_point *point = &segment->points[i];
-
-					u64 ret = snprintf(buffer + buffer_count, buffer_capacity - buffer_count, "p %f %f\n", point->pos.x, point->pos.y);
-					CLIB_ASSERT(ret < (buffer_capacity - buffer_count), "Out of space in buffer");
-					buffer_count += ret;
-				}
-
-				segment = segment->next;
-			}
-
-			stroke = stroke->next;
-		}
-
-		page = page->next;
+		v2 position = fn_note_page_position(note, app->lasso_page->page_number);
+		glUniform2f(app->canvas_shader.translate, position.x, position.y);
+		fn_canvas_draw_lines(app, GL_LINE_LOOP, app->lasso.data, app->lasso.count);
 	}
 
-	printf("%s\n", buffer);
+	if (app->selection_page && app->selection.count > 0)
+	{
+		v2 position = fn_note_page_position(note, app->selection_page->page_number);
+		v2 corners[4] = {
+			app->selection_min,
+			(v2){app->selection_max.x, app->selection_min.y},
+			app->selection_max,
+			(v2){app->selection_min.x, app->selection_max.y},
+		};
+		glUniform2f(app->canvas_shader.translate, position.x, position.y);
+		fn_canvas_set_model(app, app->selection_transform);
+		fn_canvas_draw_lines(app, GL_LINE_LOOP, corners, 4);
+		fn_canvas_set_model(app, FN_AFFINE_IDENTITY);
+	}
+}
 
-	FILE *f = fopen(path, "w");	
-	CLIB_ASSERT(f, "Failed to open file");
-	CLIB_ASSERT(fwrite(buffer, 1, buffer_count, f) == buffer_count, "Failed to write");
-	fclose(f);
+void fn_app_save(fn_app_state *app)
+{
+	if (fn_saver_request(&app->saver, app->current_note, FN_NOTE_PATH, FN_FILE_BINARY))
+	{
+		app->save_pending = 0;
+		app->note_dirty = 0;
+		app->last_save_time = app->time;
+	}
+	else
+		app->save_pending = 1;
+}
 
-	clib_arena_stop_scratch(app->mem);
+void fn_app_update_save(fn_app_state *app)
+{
+	if (app->save_pending || (app->note_dirty && app->time - app->last_save_time > FN_AUTOSAVE_INTERVAL))
+		fn_app_save(app);
 }
 
-void fn_note_read_file(fn_app_state *app, fn_note *note, const char *path)
+#ifdef CLIB_ARENA_TELEMETRY
+void fn_app_write_arena_telemetry(fn_app_state *app)
 {
+	FILE *file = fopen(FN_ARENA_TELEMETRY_PATH, "w");
+	if (file == NULL)
+	{
+		printf("Warning: Failed to open %s\n", FN_ARENA_TELEMETRY_PATH);
+		return;
+	}
 
+	// The saver's arena belongs to its thread, so only the main thread's arenas are written
+	fprintf(file, "{\"app\": ");
+	clib_arena_telemetry_write_json(app->mem, file);
+	fprintf(file, ",\n\"current_note\": ");
+	fn_note_write_arena_telemetry(app->current_note, file);
+	fprintf(file, "}\n");
+
+	fclose(file);
+	printf("Wrote arena telemetry to %s\n", FN_ARENA_TELEMETRY_PATH);
 }
+#endif
 
-GLuint fn_shader_load(clib_arena *arena, const char *vertex_path, const char *fragment_path)
+static GLuint fn_shader_compile_program(clib_arena *arena, const char *vertex_path, const char *fragment_path)
 {
 	GLuint vert, frag, prog;
 	vert = 0;
@@ -220,7 +283,7 @@ GLuint fn_shader_load(clib_arena *arena, const char *vertex_path, const char *fr
 		GLint info_log_length;
 		char *info_log;
 		glGetShaderiv(vert, GL_INFO_LOG_LENGTH, &info_log_length);
-		clib_arena_alloc(arena, info_log_length);
+		info_log = clib_arena_alloc(arena, info_log_length);
 		glGetShaderInfoLog(vert, info_log_length, NULL, info_log);
 		printf("Failed to compile vertex shader: %s\n", vertex_path);
 		printf("%s\n", info_log);
@@ -240,7 +303,7 @@ GLuint fn_shader_load(clib_arena *arena, const char *vertex_path, const char *fr
 		GLint info_log_length;
 		char *info_log;
 		glGetShaderiv(frag, GL_INFO_LOG_LENGTH, &info_log_length);
-		clib_arena_alloc(arena, info_log_length);
+		info_log = clib_arena_alloc(arena, info_log_length);
 		glGetShaderInfoLog(frag, info_log_length, NULL, info_log);
 		printf("Failed to compile fragment shader: %s\n", fragment_path);
 		printf("%s\n", info_log);
@@ -261,7 +324,7 @@ GLuint fn_shader_load(clib_arena *arena, const char *vertex_path, const char *fr
 		GLint info_log_length;
 		char *info_log;
 		glGetProgramiv(prog, GL_INFO_LOG_LENGTH, &info_log_length);
-		clib_arena_alloc(arena, info_log_length);
+		info_log = clib_arena_alloc(arena, info_log_length);
 		glGetProgramInfoLog(prog, info_log_length, NULL, info_log);
 		printf("Failed to link program: (%s, %s)\n", vertex_path, fragment_path);
 		printf("%s\n", info_log);
@@ -278,6 +341,15 @@ GLuint fn_shader_load(clib_arena *arena, const char *vertex_path, const char *fr
 	return prog;
 }
 
+GLuint fn_shader_load(clib_arena *arena, const char *vertex_path, const char *fragment_path)
+{
+	// Shader sources and info logs are only needed until the program is linked
+	clib_arena_marker scratch = clib_arena_mark(arena);
+	GLuint prog = fn_shader_compile_program(arena, vertex_path, fragment_path);
+	clib_arena_restore(&scratch);
+	return prog;
+}
+
 // (framebuffer centre in point space.xy, framebuffer in point space.xy)
 //	float x = (a_point.x*u_scale.x - u_transform.x) / (u_transform.z * 0.5);
 //	float y = (u_transform.y - a_point.y*u_scale.y) / (u_transform.w * 0.5);
@@ -308,128 +380,281 @@ v2 fn_pixel_to_point(v2 point, v2 viewport, v2 framebuffer, float DPI)
 	 return points_from_origin;
 }
 
-void fn_note_init(fn_note *note)
+static i32 fn_input_queue_push(fn_input_queue *queue, fn_input_event event)
+{
+	u64 tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	u64 head = atomic_load_explicit(&queue->head, memory_order_acquire);
+	if (tail - head == FN_INPUT_QUEUE_SIZE)
+	{
+		queue->num_dropped++;
+		return 0;
+	}
+
+	queue->events[tail & (FN_INPUT_QUEUE_SIZE - 1)] = event;
+	atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+	return 1;
+}
+
+static i32 fn_input_queue_pop(fn_input_queue *queue, fn_input_event *event)
+{
+	u64 head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	u64 tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+	if (head == tail) return 0;
+
+	*event = queue->events[head & (FN_INPUT_QUEUE_SIZE - 1)];
+	atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+	return 1;
+}
+
+void fn_glfw_cursor_pos_callback(GLFWwindow* window, double x, double y)
 {
-	note->viewport = (v2){-10.0f, -10.0f};
-	note->page_size = V2_A4_SIZE;
-	note->DPI = 100.0f;
-	note->page_separation = 72.0f;
-	note->mem = clib_arena_init(100*1024);
+	fn_app_state *app = (fn_app_state*)glfwGetWindowUserPointer(window);
+	CLIB_ASSERT(app, "app is NULL");
 
-	note->first_page = clib_arena_alloc(note->mem, sizeof(fn_page));
-	fn_page_init(note->first_page);
+	fn_input_queue_push(&app->input, (fn_input_event){
+		.time = glfwGetTime(),
+		.screen = (v2){(f32)x, (f32)y},
+		.type = FN_INPUT_MOVE,
+	});
+}
 
-	note->first_page->next = clib_arena_alloc(note->mem, sizeof(fn_page));
-	fn_page_init(note->first_page->next);
+void fn_glfw_mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
+{
+	fn_app_state *app = (fn_app_state*)glfwGetWindowUserPointer(window);
+	CLIB_ASSERT(app, "app is NULL");
 
-	fn_page_info_recalc(note);
+	double x, y;
+	glfwGetCursorPos(window, &x, &y);
+	fn_input_queue_push(&app->input, (fn_input_event){
+		.time = glfwGetTime(),
+		.screen = (v2){(f32)x, (f32)y},
+		.type = FN_INPUT_BUTTON,
+		.button = button,
+		.is_down = action == GLFW_PRESS,
+	});
 }
 
-fn_stroke *fn_page_begin_stroke(fn_page *page)
+void fn_process_input(fn_app_state *app)
 {
-	if (page->first_stroke == NULL)
+	// The pen sees every event since the last frame in order, with its own position and time,
+	// the other tools only need where things ended up
+	fn_input_event event;
+	while (fn_input_queue_pop(&app->input, &event))
 	{
-		page->first_stroke = clib_arena_alloc(page->mem, sizeof(fn_stroke));
+		app->mouse_screen = event.screen;
+		app->mouse_canvas = fn_pixel_to_point(app->mouse_screen, app->current_note->viewport, app->framebuffer_size, app->current_note->DPI);
+		if (event.type == FN_INPUT_BUTTON && event.button == GLFW_MOUSE_BUTTON_1)
+			app->is_lmb_down = event.is_down;
+		if (event.type == FN_INPUT_BUTTON && event.button == GLFW_MOUSE_BUTTON_2)
+			app->is_rmb_down = event.is_down;
+
+		if (app->tool == FN_TOOL_PEN)
+			fn_input_pen(app, app->is_lmb_down, event.time);
 	}
-	if (page->final_stroke == NULL)
+
+	if (app->input.num_dropped > 0)
 	{
-		page->final_stroke = page->first_stroke;
-		return page->final_stroke;
+		printf("Warning: Dropped %llu input events\n", app->input.num_dropped);
+		app->input.num_dropped = 0;
 	}
 
-	fn_stroke *stroke = clib_arena_alloc(page->mem, sizeof(fn_stroke));
-	page->final_stroke->next = stroke;
-	page->final_stroke = stroke;
+	// The viewport may have moved under a still cursor
+	app->mouse_canvas = fn_pixel_to_point(app->mouse_screen, app->current_note->viewport, app->framebuffer_size, app->current_note->DPI);
+
+	if (app->tool == FN_TOOL_LASSO)
+		fn_input_lasso(app, app->is_lmb_down);
+	else if (app->tool != FN_TOOL_PEN)
+		fn_input_eraser(app, app->is_lmb_down);
 
-	return stroke;
+	fn_input_move(app, app->is_rmb_down);
 }
 
-fn_segment *fn_stroke_begin_segment(fn_page *page, fn_stroke *stroke)
+void fn_input_eraser(fn_app_state *app, i32 is_eraser_down)
 {
-	CLIB_ASSERT(page, "no page");
-	CLIB_ASSERT(stroke, "no stroke");
-
-	if (stroke->final_segment == NULL) {
-		stroke->final_segment = &stroke->first_segment;
-		return stroke->final_segment;
+	fn_history *history = &app->current_note->history;
+	if (!is_eraser_down)
+	{
+		if (history->is_open) fn_note_history_end(app->current_note);
+		app->erase_page = NULL;
+		return;
 	}
 
-	fn_segment *segment = clib_arena_alloc(page->mem, sizeof(fn_segment));
-	stroke->final_segment->next = segment;
-	stroke->final_segment = segment;
-	
-	return segment;
+	fn_page *page = fn_page_at_point(app->current_note, app->mouse_canvas);
+	v2 position = fn_note_page_position(app->current_note, page->page_number);
+	v2 point_from_page = (v2){
+		app->mouse_canvas.x - position.x,
+		app->mouse_canvas.y - position.y,
+	};
+
+	// A still eraser would find nothing new to erase
+	if (page == app->erase_page && point_from_page.x == app->erase_point.x && point_from_page.y == app->erase_point.y)
+		return;
+	app->erase_page = page;
+	app->erase_point = point_from_page;
+
+	// Everything erased in one drag is undone together, an op for each page it crosses
+	if (history->is_open && history->open.page != page)
+		fn_note_history_end(app->current_note);
+	if (!history->is_open)
+		fn_note_history_begin(app->current_note, page);
+
+	u64 num_changed;
+	if (app->tool == FN_TOOL_ERASER)
+		num_changed = fn_page_erase_strokes(page, point_from_page, FN_ERASER_RADIUS, app->mem, &history->ids);
+	else
+		num_changed = fn_page_erase_precise(page, point_from_page, FN_ERASER_RADIUS, app->mem, &history->ids);
+
+	if (num_changed > 0)
+		app->note_dirty = 1;
 }
 
-void fn_page_init(fn_page *page)
+static void fn_app_clear_selection(fn_app_state *app)
 {
-	*page = (fn_page){0};
-	page->mem = clib_arena_init(FN_PAGE_ARENA_SIZE);
+	app->lasso_page = NULL;
+	app->lasso.count = 0;
+	app->selection_page = NULL;
+	app->selection.count = 0;
+	app->selection_transform = FN_AFFINE_IDENTITY;
+	app->selection_drag = FN_DRAG_NONE;
 }
 
-void fn_segment_add_point(fn_segment *segment, fn_point point)
+static void fn_app_update_selection_bounds(fn_app_state *app)
 {
-	CLIB_ASSERT(segment->num_points < FN_NUM_SEGMENT_POINTS, "Segment full!");
-	segment->points[segment->num_points] = point;
-	segment->num_points++;
+	u32 *strokes = app->selection.data;
+	for (u64 i = 0; i < app->selection.count; i++)
+	{
+		fn_stroke *stroke = &app->selection_page->strokes[strokes[i]];
+		v2 min = stroke->bounding_box_pos;
+		v2 max = (v2){min.x + stroke->bounding_box_size.x, min.y + stroke->bounding_box_size.y};
+
+		if (i == 0 || min.x < app->selection_min.x) app->selection_min.x = min.x;
+		if (i == 0 || min.y < app->selection_min.y) app->selection_min.y = min.y;
+		if (i == 0 || max.x > app->selection_max.x) app->selection_max.x = max.x;
+		if (i == 0 || max.y > app->selection_max.y) app->selection_max.y = max.y;
+	}
 }
 
-fn_page *fn_page_at_point(fn_note *note, v2 point)
+void fn_input_lasso(fn_app_state *app, i32 is_lasso_down)
 {
-	fn_page *page = note->first_page;
-	v2 page_pos = (v2){0.0f, 0.0f};
-
-	while (page != NULL)
+	if (!is_lasso_down)
 	{
-		// Work out the y bounds for the page
-
-		// Just need to check it's not overlapping into the NEXT page
-		// Pages are always in order, so if we are at a page, we've already checked previous pages
-		// so it's definitely NOT in a previous page.
-		// This has the added benefit of attaching anything at a negative coordinate to page 1
-		// especially important for infinite page in the future I think...
-		if (point.y < (page_pos.y + note->page_size.y + note->page_separation)) return page;
-		if (page->next == NULL) return page;
+		// Releasing bakes the dragged transform into the points, or selects what the lasso went around.
+		// A click that didn't move anything has nothing to bake.
+		if (app->selection_drag != FN_DRAG_NONE && fn_affine_is_identity(app->selection_transform))
+			app->selection_drag = FN_DRAG_NONE;
+		else if (app->selection_drag != FN_DRAG_NONE)
+		{
+			// The originals are hidden, so the selection moves on to their copies.
+			// Ending the op can compact the page, but the copies are still its last strokes.
+			fn_note *note = app->current_note;
+			fn_note_history_begin(note, app->selection_page);
+			fn_page_transform_strokes(app->selection_page, app->selection.data, app->selection.count,
+					app->selection_transform, &note->history.ids);
+			fn_note_history_end(note);
+			u64 first_copy = app->selection_page->num_strokes - app->selection.count;
+
+			u32 *strokes = app->selection.data;
+			for (u64 i = 0; i < app->selection.count; i++)
+				strokes[i] = (u32)(first_copy + i);
+			fn_app_update_selection_bounds(app);
+			app->selection_transform = FN_AFFINE_IDENTITY;
+			app->selection_drag = FN_DRAG_NONE;
+			app->note_dirty = 1;
+		}
+		else if (app->lasso_page)
+		{
+			clib_arena_marker scratch = clib_arena_mark(app->mem);
+			u32 *strokes;
+			u64 num_strokes = fn_page_select_lasso(app->lasso_page, app->lasso.data, app->lasso.count, app->mem, &strokes);
+			for (u64 i = 0; i < num_strokes; i++)
+				clib_vector_push(&app->selection, &strokes[i]);
+			clib_arena_restore(&scratch);
+
+			if (num_strokes > 0)
+			{
+				app->selection_page = app->lasso_page;
+				fn_app_update_selection_bounds(app);
+			}
+			app->lasso_page = NULL;
+			app->lasso.count = 0;
+		}
+		return;
+	}
 
+	// A press in the selection's bounds drags it, anywhere else starts a new lasso
+	if (app->lasso_page == NULL && app->selection_drag == FN_DRAG_NONE)
+	{
+		fn_page *page = fn_page_at_point(app->current_note, app->mouse_canvas);
+		v2 position = fn_note_page_position(app->current_note, page->page_number);
+		v2 point_from_page = (v2){
+			app->mouse_canvas.x - position.x,
+			app->mouse_canvas.y - position.y,
+		};
 
-		page = page->next;
-		page_pos.y += note->page_size.y + note->page_separation;
+		if (page == app->selection_page &&
+				point_from_page.x >= app->selection_min.x && point_from_page.x <= app->selection_max.x &&
+				point_from_page.y >= app->selection_min.y && point_from_page.y <= app->selection_max.y)
+		{
+			if (glfwGetKey(app->window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS)
+				app->selection_drag = FN_DRAG_SCALE;
+			else if (glfwGetKey(app->window, GLFW_KEY_LEFT_CONTROL) == GLFW_PRESS)
+				app->selection_drag = FN_DRAG_ROTATE;
+			else
+				app->selection_drag = FN_DRAG_MOVE;
+			app->selection_anchor = point_from_page;
+		}
+		else
+		{
+			fn_app_clear_selection(app);
+			fn_page_materialise(page);
+			app->lasso_page = page;
+		}
 	}
-	
-	// If we didn't find the page, then it must be further down than the last page so attach it to that??
-	// TODO: This might need some rework when adding an additional page at the end...
-	return page;
-}
 
-void fn_page_info_recalc(fn_note *note)
-{
-	fn_page *page = note->first_page;
-	u64 current_page = 0;
-	v2 page_pos = V2_ZERO;
+	fn_page *page = app->selection_drag != FN_DRAG_NONE ? app->selection_page : app->lasso_page;
+	v2 position = fn_note_page_position(app->current_note, page->page_number);
+	v2 point_from_page = (v2){
+		app->mouse_canvas.x - position.x,
+		app->mouse_canvas.y - position.y,
+	};
 
-	while (page != NULL)
+	if (app->selection_drag != FN_DRAG_NONE)
 	{
-		page->page_number = current_page;
-		page->position = page_pos;
+		v2 centre = (v2){
+			(app->selection_min.x + app->selection_max.x) * 0.5f,
+			(app->selection_min.y + app->selection_max.y) * 0.5f,
+		};
+		v2 from = (v2){app->selection_anchor.x - centre.x, app->selection_anchor.y - centre.y};
+		v2 to = (v2){point_from_page.x - centre.x, point_from_page.y - centre.y};
+
+		f32 scale = 1.0f;
+		f32 angle = 0.0f;
+		v2 translation = V2_ZERO;
+		if (app->selection_drag == FN_DRAG_MOVE)
+			translation = (v2){to.x - from.x, to.y - from.y};
+		else if (app->selection_drag == FN_DRAG_SCALE)
+		{
+			f32 from_length = sqrtf(from.x * from.x + from.y * from.y);
+			f32 to_length = sqrtf(to.x * to.x + to.y * to.y);
+			if (from_length > 1.0f) scale = to_length / from_length;
+			if (scale < 0.05f) scale = 0.05f;
+		}
+		else
+			angle = atan2f(to.y, to.x) - atan2f(from.y, from.x);
 
-		current_page++;
-		page = page->next;
-		page_pos.y += note->page_size.y + note->page_separation;
+		app->selection_transform = fn_affine_about(centre, scale, angle, translation);
+		return;
 	}
-}
 
-void fn_process_input(fn_app_state *app)
-{
-	i32 is_lmb_down = glfwGetMouseButton(app->window, GLFW_MOUSE_BUTTON_1) == GLFW_PRESS;
-	i32 is_rmb_down = glfwGetMouseButton(app->window, GLFW_MOUSE_BUTTON_2) == GLFW_PRESS;
-
-	if (app->tool == FN_TOOL_PEN)
+	// Only keep lasso points that are far enough apart to matter
+	if (app->lasso.count > 0)
 	{
-		fn_input_pen(app, is_lmb_down);
-		fn_input_move(app, is_rmb_down);
+		v2 *last = clib_vector_at(&app->lasso, app->lasso.count - 1);
+		f32 dx = point_from_page.x - last->x;
+		f32 dy = point_from_page.y - last->y;
+		if (dx * dx + dy * dy < 1.0f) return;
 	}
-	else
-		app->drawing_page = NULL;
+	clib_vector_push(&app->lasso, &point_from_page);
 }
 
 void fn_input_move(fn_app_state *app, i32 is_move_down)
@@ -459,15 +684,21 @@ void fn_input_move(fn_app_state *app, i32 is_move_down)
 	app->current_note->viewport.y = app->old_viewport.y - movement.y;
 }
 
-void fn_input_pen(fn_app_state *app, i32 is_pen_down)
+void fn_input_pen(fn_app_state *app, i32 is_pen_down, f64 time)
 {
 	// If not holding left click, then we are no longer drawing
 
 	if (!is_pen_down)
 	{
+		if (app->drawing_page)
+		{
+			// The stroke ends where the pen was lifted, even if the sampler skipped it
+			fn_point last;
+			if (fn_sampler_end(&app->sampler, &last))
+				fn_page_add_point(app->drawing_page, last);
+			fn_note_history_end(app->current_note);
+		}
 		app->drawing_page = NULL;
-		app->drawing_stroke = NULL;
-		app->drawing_segment = NULL;
 		return;
 	}
 
@@ -475,55 +706,55 @@ void fn_input_pen(fn_app_state *app, i32 is_pen_down)
 	if (app->drawing_page == NULL)
 	{
 		fn_page *page = fn_page_at_point(app->current_note, app->mouse_canvas);
+		v2 position = fn_note_page_position(app->current_note, page->page_number);
 
 		v2 point_from_page = (v2){
-			app->mouse_canvas.x - page->position.x,
-			app->mouse_canvas.y - page->position.y,
+			app->mouse_canvas.x - position.x,
+			app->mouse_canvas.y - position.y,
 		};
 
-		if ((point_from_page.x > 0.0f && point_from_page.x < app->current_note->page_size.x) && 
-				(point_from_page.y > 0.0f && point_from_page.y < app->current_note->page_size.y))
+		if ((point_from_page.x > 0.0f && point_from_page.x < page->size.x) && 
+				(point_from_page.y > 0.0f && point_from_page.y < page->size.y))
 		{
-			// Create a stroke and segment to start drawing to
+			// Create a stroke to start drawing to
+			fn_page_materialise(page);
 			app->drawing_page = page;
-			app->drawing_stroke = fn_page_begin_stroke(app->drawing_page);
-			app->drawing_segment = fn_stroke_begin_segment(app->drawing_page, app->drawing_stroke);
+			fn_note_history_begin(app->current_note, page);
+			fn_page_begin_stroke(app->drawing_page);
+			fn_sampler_begin(&app->sampler);
+			app->stroke_start_time = time;
 		}
 	}
 
-	// If we are now actually drawing, and the polling rate hasn't been exceeded, then draw!
-	if (app->drawing_page && (app->time - app->last_point_time > FN_POINT_SAMPLE_TIME))
+	// If we are now actually drawing, let the sampler decide what's worth keeping
+	if (app->drawing_page)
 	{
-		CLIB_ASSERT(app->drawing_stroke, "No stroke");
-		CLIB_ASSERT(app->drawing_segment, "No segment");
-
 		// Calculated mouse position from current page origin
+		v2 position = fn_note_page_position(app->current_note, app->drawing_page->page_number);
 		v2 point_from_page  = (v2){
-			app->mouse_canvas.x - app->drawing_page->position.x,
-			app->mouse_canvas.y - app->drawing_page->position.y,
+			app->mouse_canvas.x - position.x,
+			app->mouse_canvas.y - position.y,
 		};
 
-		// Allocate a new segment if needed
-		if (app->drawing_segment->num_points >= FN_NUM_SEGMENT_POINTS)
-			app->drawing_segment = fn_stroke_begin_segment(app->drawing_page, app->drawing_stroke);
-
 		// Clamp point to page
 		// Drawing can only begin in page, but can go back out, I don't really want this...
 
 		if (point_from_page.x < 0.0f) point_from_page.x = 0.0f;
 		if (point_from_page.y < 0.0f) point_from_page.y = 0.0f;
-		if (point_from_page.x > app->current_note->page_size.x) point_from_page.x = app->current_note->page_size.x;
-		if (point_from_page.y > app->current_note->page_size.y) point_from_page.y = app->current_note->page_size.y;
+		if (point_from_page.x > app->drawing_page->size.x) point_from_page.x = app->drawing_page->size.x;
+		if (point_from_page.y > app->drawing_page->size.y) point_from_page.y = app->drawing_page->size.y;
 
-		// Add point to segment
-		fn_segment_add_point(app->drawing_segment, (fn_point) {
+		fn_point kept[2];
+		u32 num_kept = fn_sampler_add(&app->sampler, (fn_point) {
 				.pos = point_from_page,
-				.t = 0.0f,
+				.t = (f32)(time - app->stroke_start_time),
 				.pressure = 0.0f
-		});
+		}, kept);
 
-		// Track time so we can stick to polling rate
-		app->last_point_time = app->time;
+		for (u32 i = 0; i < num_kept; i++)
+			fn_page_add_point(app->drawing_page, kept[i]);
+		if (num_kept > 0)
+			app->note_dirty = 1;
 	}
 }
 
@@ -541,12 +772,16 @@ void fn_app_init(fn_app_state *app)
 
 	glfwSetWindowUserPointer(app->window, app);
 	glfwSetKeyCallback(app->window, fn_glfw_key_callback);
+	glfwSetCursorPosCallback(app->window, fn_glfw_cursor_pos_callback);
+	glfwSetMouseButtonCallback(app->window, fn_glfw_mouse_button_callback);
+	atomic_init(&app->input.head, 0);
+	atomic_init(&app->input.tail, 0);
 
 	// Load shaders (using scratch arena)
-	clib_arena_start_scratch(app->mem);
+	clib_arena_marker scratch = clib_arena_mark(app->mem);
 	app->canvas_shader.program = fn_shader_load(app->mem, "src/canvas.vert", "src/canvas.frag");
 	CLIB_ASSERT(app->canvas_shader.program, "Failed to load canvas shader");
-	clib_arena_stop_scratch(app->mem);
+	clib_arena_restore(&scratch);
 
 	// Get shader uniforms
 	app->canvas_shader.transform = glGetUniformLocation(app->canvas_shader.program, "u_transform");
@@ -557,6 +792,8 @@ void fn_app_init(fn_app_state *app)
 	CLIB_ASSERT(app->canvas_shader.scale != -1, "Failed to get uniform location");
 	app->canvas_shader.translate = glGetUniformLocation(app->canvas_shader.program, "u_translate");
 	CLIB_ASSERT(app->canvas_shader.translate != -1, "Failed to get uniform location");
+	app->canvas_shader.model = glGetUniformLocation(app->canvas_shader.program, "u_model");
+	CLIB_ASSERT(app->canvas_shader.model != -1, "Failed to get uniform location");
 
 	// Create buffers for strokes and squares
 	glGenBuffers(1, &app->stroke_buffer);
@@ -569,47 +806,17 @@ void fn_app_init(fn_app_state *app)
 	app->tool = FN_TOOL_PEN;
 	app->move_speed = 3.0f;
 
-	app->current_note = clib_arena_alloc(app->mem, sizeof(fn_note));
-	fn_note_init(app->current_note);
-}
-
-void fn_note_destroy(fn_note *note)
-{
-	fn_page *page = note->first_page;
-	while (page != NULL)
-	{
-		fn_page *next_page = page->next;
-		fn_page_destroy(page);
-		page = next_page;
-	}
-	clib_arena_destroy(&note->mem);
-	*note = (fn_note){0};
-}
-
-void fn_page_destroy(fn_page *page)
-{
-	clib_arena_destroy(&page->mem);
-	*page = (fn_page){0};
-}
+	clib_vector_init(&app->lasso, sizeof(v2));
+	clib_vector_init(&app->selection, sizeof(u32));
+	app->selection_transform = FN_AFFINE_IDENTITY;
 
-void fn_note_print_info(fn_note *note)
-{
-	u64 total_page_data = 0;
+	clib_pool_init(&app->pool, 0);
 
-	clib_arena_print_info(note->mem);
-
-	fn_page *page = note->first_page;
-	while (page != NULL)
-	{
-		printf("Page %llu\n", page->page_number);
-		clib_arena_print_info(page->mem);
-		total_page_data += page->mem->total_allocation_size;
-
-		page = page->next;
-	}
-	printf("Total page data: %llu bytes\n", total_page_data);
-	printf("Total note data: %llu bytes\n", total_page_data + note->mem->total_allocation_size);
+	app->current_note = clib_arena_alloc(app->mem, sizeof(fn_note));
+	if (!fn_note_read_file(app->current_note, FN_NOTE_PATH))
+		fn_note_init(app->current_note);
 
+	fn_saver_init(&app->saver, &app->pool);
 }
 
 void fn_glfw_key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
@@ -619,21 +826,49 @@ void fn_glfw_key_callback(GLFWwindow* window, int key, int scancode, int action,
 
 	if (action == GLFW_PRESS || action == GLFW_REPEAT)
 	{
-		if (key == GLFW_KEY_M) fn_note_print_info(app->current_note);
-		if (key == GLFW_KEY_S) fn_note_write_file(app, app->current_note, "/home/alex/dev/freenote/note.fn");
-		if (key == GLFW_KEY_P) 
+		if (key == GLFW_KEY_M)
+		{
+			fn_note_print_info(app->current_note);
+#ifdef CLIB_ARENA_TELEMETRY
+			fn_app_write_arena_telemetry(app);
+#endif
+		}
+		if (key == GLFW_KEY_S) fn_app_save(app);
+		if (key == GLFW_KEY_P && !app->current_note->history.is_open)
+		{
+			fn_page *page = fn_note_append_page(app->current_note);
+			fn_note_history_insert_page(app->current_note, page);
+		}
+		if ((key == GLFW_KEY_Z || key == GLFW_KEY_Y) && (mods & GLFW_MOD_CONTROL) && !app->current_note->history.is_open)
 		{
-			fn_page *page = app->current_note->first_page;
-			while (page)
+			// Ctrl+Z undoes, Ctrl+Y or Ctrl+Shift+Z redoes
+			i32 changed;
+			if (key == GLFW_KEY_Y || (mods & GLFW_MOD_SHIFT))
+				changed = fn_note_redo(app->current_note);
+			else
+				changed = fn_note_undo(app->current_note);
+
+			if (changed)
 			{
-				if (page->next == NULL) break;
-				page = page->next;
+				fn_app_clear_selection(app);
+				app->note_dirty = 1;
 			}
-			// Page is last page
-			fn_page *new_page = clib_arena_alloc(app->current_note->mem, sizeof(fn_page));
-			page->next = new_page;
-			fn_page_init(new_page);
-			fn_page_info_recalc(app->current_note);
+		}
+		if (key >= GLFW_KEY_1 && key <= GLFW_KEY_4 && !app->current_note->history.is_open)
+		{
+			// Other tools change strokes, which would leave the selection's indices stale
+			if (key == GLFW_KEY_1) app->tool = FN_TOOL_PEN;
+			if (key == GLFW_KEY_2) app->tool = FN_TOOL_ERASER;
+			if (key == GLFW_KEY_3) app->tool = FN_TOOL_PRECISE_ERASER;
+			if (key == GLFW_KEY_4) app->tool = FN_TOOL_LASSO;
+			fn_app_clear_selection(app);
+		}
+		if (key == GLFW_KEY_O && app->drawing_page == NULL)
+		{
+			// Turn the page under the cursor between portrait and landscape
+			fn_page *page = fn_page_at_point(app->current_note, app->mouse_canvas);
+			fn_note_set_page_size(app->current_note, page->page_number, (v2){page->size.y, page->size.x});
+			app->note_dirty = 1;
 		}
 	}
 }
@@ -2,85 +2,17 @@
 #define _FREENOTE_H_
 
 #include "clib.h"
+#include "note.h"
 
 #define GLFW_INCLUDE_NONE
 #include <GLFW/glfw3.h>
 #include <glad/glad.h>
 
-/*
- * The units for sizes in canvas is POINTS
- * This is the default unit for a PDF file
- * 1 point = 1/72 inch
- * A4 = 595x842 points
-*/
-
-#define VERSION_MAJOR 0
-#define VERSION_MINOR 0
-#define VERSION_REVISION 0
-#define VERSION_STRING "v0.0.0"
-
-#define FN_NUM_SEGMENT_POINTS 16
-#define FN_POINT_SAMPLE_TIME 0.01f
-#define FN_PAGE_ARENA_SIZE (1024*1024)
-
-#define V2_ZERO ((v2){0.0f, 0.0f})
-#define V2_A4_SIZE ((v2){595.0f, 842.0f})
-
-typedef struct
-{
-	f32 x;
-	f32 y;
-} v2;
-
-typedef struct fn_point
-{
-	v2 pos;
-	f32 t;
-	f32 pressure;
-} fn_point;
-
-typedef struct fn_segment
-{
-	fn_point points[FN_NUM_SEGMENT_POINTS];
-	u64 num_points;
-	struct fn_segment *next;
-} fn_segment;
-
-typedef struct fn_stroke
-{
-	fn_segment first_segment;
-	fn_segment *final_segment;
-	v2 bounding_box_pos;
-	v2 bounding_box_size;
-	struct fn_stroke *next;
-} fn_stroke;
-
-typedef struct fn_page
-{
-	clib_arena *mem;
-
-	v2 position;
-	u64 page_number;
-
-	fn_stroke *first_stroke;	
-	fn_stroke *final_stroke;
-
-	struct fn_page *prev;
-	struct fn_page *next;
-} fn_page;
-
-typedef struct
-{
-	clib_arena *mem;
-
-	fn_page *first_page;
-
-	v2 viewport;
-	f32 DPI;
-
-	v2 page_size;
-	f32 page_separation;
-} fn_note;
+#define FN_AUTOSAVE_INTERVAL 30.0f
+#define FN_INPUT_QUEUE_SIZE 2048 // Input events waiting for the next frame, a power of two
+#define FN_ERASER_RADIUS 6.0f // In points
+#define FN_NOTE_PATH "/home/alex/dev/freenote/note.fn"
+#define FN_ARENA_TELEMETRY_PATH "arena-telemetry.json" // Written by M in CLIB_ARENA_TELEMETRY builds
 
 typedef enum
 {
@@ -91,8 +23,44 @@ typedef enum
 typedef enum
 {
 	FN_TOOL_PEN,
+	FN_TOOL_ERASER, // Removes whole strokes
+	FN_TOOL_PRECISE_ERASER, // Cuts strokes where it passes over them
+	FN_TOOL_LASSO, // Selects strokes to move, scale (shift) or rotate (control)
 } fn_tool;
 
+typedef enum
+{
+	FN_DRAG_NONE,
+	FN_DRAG_MOVE,
+	FN_DRAG_SCALE,
+	FN_DRAG_ROTATE,
+} fn_drag;
+
+typedef enum
+{
+	FN_INPUT_MOVE,
+	FN_INPUT_BUTTON,
+} fn_input_event_type;
+
+typedef struct fn_input_event
+{
+	f64 time; // glfwGetTime when the event arrived
+	v2 screen; // Cursor position in pixels
+	u32 type;
+	i32 button; // FN_INPUT_BUTTON only
+	i32 is_down;
+} fn_input_event;
+
+// Single producer, single consumer ring of input events, the GLFW callbacks push and the frame pops.
+// Both run on the main thread for now, but nothing stops event polling from getting its own thread.
+typedef struct fn_input_queue
+{
+	fn_input_event events[FN_INPUT_QUEUE_SIZE];
+	_Atomic u64 head; // Next event to pop, only moved by the consumer
+	_Atomic u64 tail; // Next slot to push to, only moved by the producer
+	u64 num_dropped; // Pushed while full
+} fn_input_queue;
+
 typedef struct fn_app_state
 {
 	clib_arena *mem;
@@ -106,19 +74,44 @@ typedef struct fn_app_state
 	v2 movement_anchor;	
 
 	// Drawing
-	fn_page *drawing_page;
-	fn_stroke *drawing_stroke;
-	fn_segment *drawing_segment;
-	f32 last_point_time;
+	fn_page *drawing_page; // Its final stroke is being drawn
+	fn_sampler sampler;
+	f64 stroke_start_time; // Points' t is from here
+
+	// Erasing
+	fn_page *erase_page; // Where the eraser last ran while held, NULL once it's released
+	v2 erase_point; // relative to erase_page
+
+	// Lasso
+	fn_page *lasso_page; // Page the lasso is being drawn on
+	clib_vector lasso; // v2, relative to lasso_page
+	fn_page *selection_page;
+	clib_vector selection; // u32 stroke indices of selection_page
+	v2 selection_min;
+	v2 selection_max;
+	fn_affine selection_transform; // Drawn by the shader while dragging, baked into the points on release
+	fn_drag selection_drag;
+	v2 selection_anchor;
 
 	fn_mode mode;
 	fn_tool tool;
 
+	clib_pool pool;
+
+	// Saving
+	fn_saver saver;
+	i32 save_pending; // Save requested while the saver was busy
+	i32 note_dirty;
+	f32 last_save_time;
+
 	// Platform data
 	GLFWwindow *window;
 
+	fn_input_queue input;
 	v2 mouse_screen;
 	v2 mouse_canvas;
+	i32 is_lmb_down;
+	i32 is_rmb_down;
 
 	i32 framebuffer_width;
 	i32 framebuffer_height;
@@ -136,6 +129,7 @@ typedef struct fn_app_state
 		GLint colour;
 		GLint scale;
 		GLint translate;
+		GLint model;
 	} canvas_shader;
 } fn_app_state;
 
@@ -144,28 +138,22 @@ int main();
 void fn_app_init(fn_app_state *app);
 
 void fn_process_input(fn_app_state *app);
-void fn_input_pen(fn_app_state *app, i32 is_pen_down);
+void fn_input_pen(fn_app_state *app, i32 is_pen_down, f64 time); // Called for every input event while the pen is the tool
 void fn_input_move(fn_app_state *app, i32 is_move_down);
+void fn_input_eraser(fn_app_state *app, i32 is_eraser_down);
+void fn_input_lasso(fn_app_state *app, i32 is_lasso_down);
 
 void fn_glfw_key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
+void fn_glfw_cursor_pos_callback(GLFWwindow* window, double x, double y);
+void fn_glfw_mouse_button_callback(GLFWwindow* window, int button, int action, int mods);
 
-void fn_note_init(fn_note *note);
-void fn_note_destroy(fn_note *note);
+void fn_app_save(fn_app_state *app);
+void fn_app_update_save(fn_app_state *app);
+#ifdef CLIB_ARENA_TELEMETRY
+void fn_app_write_arena_telemetry(fn_app_state *app);
+#endif
 
 void fn_note_draw(fn_app_state *app, fn_note *note);
-void fn_note_write_file(fn_app_state *app, fn_note *note, const char *path);
-void fn_note_read_file(fn_app_state *app, fn_note *note, const char *path);
-
-void fn_note_print_info(fn_note *note);
-
-void fn_page_init(fn_page *page);
-void fn_page_destroy(fn_page *page);
-fn_page *fn_page_at_point(fn_note *note, v2 point);
-void fn_page_info_recalc(fn_note *note);
-
-fn_stroke *fn_page_begin_stroke(fn_page *page);
-fn_segment *fn_stroke_begin_segment(fn_page *page, fn_stroke *stroke);
-void fn_segment_add_point(fn_segment *segment, fn_point point);
 
 GLuint fn_shader_load( clib_arena *arena, const char *vertex_path, const char *fragment_path);
 
@@ -0,0 +1,2485 @@
+#include "note.h"
+#include "clib.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+// Anything too big for the page arena's blocks gets a mapping of its own,
+// so how much ink a page holds isn't bounded by the block size
+static void *fn_page_alloc(fn_page *page, u64 size, u64 alignment)
+{
+	if (size <= FN_PAGE_LARGE_ALLOCATION)
+		return clib_arena_alloc_aligned(page->mem, size, alignment);
+
+	void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	CLIB_ASSERT(memory != MAP_FAILED, "Couldn't map a large page allocation");
+	page->large_allocation_size += size;
+	return memory;
+}
+
+static void fn_page_free(fn_page *page, void *memory, u64 size)
+{
+	if (size <= FN_PAGE_LARGE_ALLOCATION)
+		clib_arena_free(page->mem, memory);
+	else
+	{
+		munmap(memory, size);
+		page->large_allocation_size -= size;
+	}
+}
+
+static u64 fn_page_columns_size(u64 capacity)
+{
+	return capacity * 4 * sizeof(f32);
+}
+
+typedef struct fn_retired_columns
+{
+	struct fn_retired_columns *next;
+	u64 size;
+} fn_retired_columns;
+
+static void fn_page_free_retired(fn_page *page)
+{
+	while (page->retired != NULL)
+	{
+		fn_retired_columns *retired = page->retired;
+		page->retired = retired->next;
+		fn_page_free(page, retired, retired->size);
+	}
+}
+
+i32 fn_note_write_file(fn_note *note, clib_arena *scratch, clib_pool *pool, const char *path, fn_file_format format)
+{
+	clib_arena_marker marker = clib_arena_mark(scratch);
+
+	fn_note_snapshot snapshot;
+	fn_note_snapshot_take(&snapshot, scratch, note);
+	i32 success = fn_note_snapshot_write_file(&snapshot, pool, path, format);
+	fn_note_unpin(note);
+
+	clib_arena_restore(&marker);
+	return success;
+}
+
+void fn_note_snapshot_take(fn_note_snapshot *snapshot, clib_arena *arena, fn_note *note)
+{
+	*snapshot = (fn_note_snapshot){0};
+	snapshot->page_size = note->page_size;
+	snapshot->page_separation = note->page_separation;
+
+	snapshot->num_pages = note->num_pages;
+
+	note->num_pins++;
+	if (snapshot->num_pages == 0) return;
+	snapshot->pages = clib_arena_alloc(arena, snapshot->num_pages * sizeof(fn_page_snapshot));
+
+	for (u64 i = 0; i < snapshot->num_pages; i++)
+	{
+		fn_page *page = note->pages[i];
+		fn_page_snapshot *page_snapshot = &snapshot->pages[i];
+		*page_snapshot = (fn_page_snapshot){0};
+		page_snapshot->page_number = page->page_number;
+		page_snapshot->size = page->size;
+
+		// Old files are converted to columns on the way out, so they're decoded now
+		if (page->mem == NULL && page->mapped_version == FN_FILE_VERSION_AOS)
+			fn_page_materialise(page);
+
+		// Unmaterialised pages are written straight from the mapping
+		if (page->mem == NULL)
+		{
+			page_snapshot->mapped = page->mapped;
+			page_snapshot->mapped_data = page->mapped_data;
+			continue;
+		}
+
+		page->pinned = 1;
+		page_snapshot->num_points = page->num_points;
+		page_snapshot->x = page->points.x;
+		page_snapshot->y = page->points.y;
+		page_snapshot->t = page->points.t;
+		page_snapshot->pressure = page->points.pressure;
+
+		page_snapshot->num_strokes = page->num_strokes - page->num_hidden_strokes;
+		if (page->num_hidden_strokes > 0)
+		{
+			page_snapshot->num_points = page->num_points - page->num_hidden_points;
+			page_snapshot->gather = 1;
+		}
+
+		if (page_snapshot->num_strokes == 0) continue;
+		page_snapshot->strokes = clib_arena_alloc(arena, page_snapshot->num_strokes * sizeof(fn_stroke));
+
+		if (!page_snapshot->gather)
+		{
+			memcpy(page_snapshot->strokes, page->strokes, page->num_strokes * sizeof(fn_stroke));
+			continue;
+		}
+
+		u64 num_visible = 0;
+		for (u64 j = 0; j < page->num_strokes; j++)
+		{
+			if (!page->strokes[j].hidden)
+				page_snapshot->strokes[num_visible++] = page->strokes[j];
+		}
+	}
+}
+
+void fn_note_unpin(fn_note *note)
+{
+	CLIB_ASSERT(note->num_pins > 0, "Note isn't pinned");
+	note->num_pins--;
+	if (note->num_pins > 0) return;
+
+	for (u64 i = 0; i < note->num_pages; i++)
+	{
+		fn_page *page = note->pages[i];
+		fn_page_free_retired(page);
+		page->pinned = 0;
+	}
+
+	// Undone pages that fell out of the history were kept until now
+	fn_page **dropped = note->history.dropped_pages.data;
+	for (u64 i = 0; i < note->history.dropped_pages.count; i++)
+	{
+		fn_page_destroy(dropped[i]);
+		clib_arena_free(note->mem, dropped[i]);
+	}
+	note->history.dropped_pages.count = 0;
+}
+
+static void fn_buffer_printf(clib_vector *buffer, const char *format, ...)
+{
+	va_list args;
+
+	while (1)
+	{
+		u64 space = buffer->capacity - buffer->count;
+
+		va_start(args, format);
+		i32 ret = vsnprintf((char*)buffer->data + buffer->count, space, format, args);
+		va_end(args);
+		CLIB_ASSERT(ret >= 0, "Failed to format");
+
+		if ((u64)ret < space)
+		{
+			buffer->count += ret;
+			return;
+		}
+
+		clib_vector_resize(buffer, buffer->capacity * 2);
+	}
+}
+
+static void fn_buffer_append(clib_vector *buffer, const void *data, u64 size)
+{
+	while (buffer->count + size > buffer->capacity)
+		clib_vector_resize(buffer, buffer->capacity * 2);
+
+	memcpy((u8*)buffer->data + buffer->count, data, size);
+	buffer->count += size;
+}
+
+static void fn_buffer_align(clib_vector *buffer, u64 alignment)
+{
+	static const u8 zero = 0;
+	while (buffer->count % alignment != 0)
+		fn_buffer_append(buffer, &zero, 1);
+}
+
+static void fn_page_snapshot_encode_text(fn_page_snapshot *page, clib_vector *buffer)
+{
+	fn_buffer_printf(buffer, "p %llu\n", page->page_number);
+	fn_buffer_printf(buffer, "d %f %f\n", page->size.x, page->size.y);
+
+	if (page->mapped)
+	{
+		if (!fn_file_page_verify(page->mapped, page->mapped_data))
+		{
+			printf("Warning: Page %llu is damaged, writing it blank\n", page->page_number);
+			return;
+		}
+
+		u64 num_points = page->mapped->num_points;
+		const f32 *x = (const f32*)page->mapped_data;
+		const f32 *y = x + num_points;
+		const u32 *stroke_points = (const u32*)(page->mapped_data + num_points * sizeof(fn_point));
+		u64 point_index = 0;
+
+		for (u64 i = 0; i < page->mapped->num_strokes; i++)
+		{
+			fn_buffer_printf(buffer, "s\n");
+			for (u64 j = 0; j < stroke_points[i] && point_index < num_points; j++)
+			{
+				fn_buffer_printf(buffer, "p %f %f\n", x[point_index], y[point_index]);
+				point_index++;
+			}
+		}
+		return;
+	}
+
+	for (u64 i = 0; i < page->num_strokes; i++)
+	{
+		fn_stroke *stroke = &page->strokes[i];
+		fn_buffer_printf(buffer, "s\n");
+
+		u64 end = stroke->first_point + stroke->num_points;
+		for (u64 j = stroke->first_point; j < end; j++)
+			fn_buffer_printf(buffer, "p %f %f\n", page->x[j], page->y[j]);
+	}
+}
+
+// Encodes the page chunk, entry gets everything but the offset
+static void fn_page_snapshot_encode_binary(fn_page_snapshot *page, clib_vector *buffer, fn_file_page *entry)
+{
+	*entry = (fn_file_page){0};
+	entry->page_size = page->size;
+
+	// Copied as is, keeping the stored checksum so damage isn't papered over
+	if (page->mapped)
+	{
+		entry->num_strokes = page->mapped->num_strokes;
+		entry->num_points = page->mapped->num_points;
+		entry->crc = page->mapped->crc;
+		fn_buffer_append(buffer, page->mapped_data, page->mapped->size);
+		entry->size = buffer->count;
+		return;
+	}
+
+	// The columns go out exactly as they are stored, unless hidden strokes have to be left out
+	const f32 *columns[4] = {page->x, page->y, page->t, page->pressure};
+	for (u64 c = 0; c < 4 && page->num_points > 0; c++)
+	{
+		if (!page->gather)
+		{
+			fn_buffer_append(buffer, columns[c], page->num_points * sizeof(f32));
+			continue;
+		}
+
+		for (u64 i = 0; i < page->num_strokes; i++)
+			fn_buffer_append(buffer, columns[c] + page->strokes[i].first_point, page->strokes[i].num_points * sizeof(f32));
+	}
+
+	for (u64 i = 0; i < page->num_strokes; i++)
+	{
+		u32 num_points = (u32)page->strokes[i].num_points;
+		fn_buffer_append(buffer, &num_points, sizeof(num_points));
+	}
+
+	entry->num_points = page->num_points;
+	entry->num_strokes = page->num_strokes;
+	entry->size = buffer->count;
+	entry->crc = clib_crc32c(0, buffer->data, buffer->count);
+}
+
+typedef struct fn_encode_job
+{
+	fn_note_snapshot *snapshot;
+	fn_file_format format;
+	clib_vector *buffers; // One per page
+	fn_file_page *entries;
+} fn_encode_job;
+
+static void fn_encode_page_job(void *data, u64 index)
+{
+	fn_encode_job *job = data;
+	clib_vector *buffer = &job->buffers[index];
+
+	*buffer = (clib_vector){0};
+	clib_vector_init_reserve(buffer, 1, 4096);
+
+	if (job->format == FN_FILE_BINARY)
+		fn_page_snapshot_encode_binary(&job->snapshot->pages[index], buffer, &job->entries[index]);
+	else
+		fn_page_snapshot_encode_text(&job->snapshot->pages[index], buffer);
+}
+
+void fn_note_snapshot_encode(fn_note_snapshot *snapshot, clib_pool *pool, fn_file_format format, clib_vector *out)
+{
+	// Pages are independent, so each one is encoded into its own buffer in parallel
+	// and the buffers are stitched together in page order afterwards
+	fn_encode_job job = {
+		.snapshot = snapshot,
+		.format = format,
+		.buffers = calloc(snapshot->num_pages + 1, sizeof(clib_vector)),
+		.entries = calloc(snapshot->num_pages + 1, sizeof(fn_file_page)),
+	};
+	CLIB_ASSERT(job.buffers && job.entries, "calloc failed");
+
+	clib_pool_run(pool, snapshot->num_pages, fn_encode_page_job, &job);
+
+	clib_vector buffer = {0};
+	u64 total_size = 0;
+	CLIB_ASSERT(out->data == NULL, "out already has data");
+
+	if (format == FN_FILE_BINARY)
+	{
+		fn_file_header header = {
+			.magic = FN_FILE_MAGIC,
+			.version = FN_FILE_VERSION,
+			.num_pages = snapshot->num_pages,
+			.page_size = snapshot->page_size,
+			.page_separation = snapshot->page_separation,
+		};
+
+		// Lay out the chunks 8 byte aligned after the page table
+		u64 offset = sizeof(fn_file_header) + snapshot->num_pages * sizeof(fn_file_page);
+		for (u64 i = 0; i < snapshot->num_pages; i++)
+		{
+			offset = (offset + 7) & ~7ull;
+			job.entries[i].offset = offset;
+			offset += job.entries[i].size;
+		}
+		total_size = offset;
+		header.table_crc = clib_crc32c(0, job.entries, snapshot->num_pages * sizeof(fn_file_page));
+
+		clib_vector_init_reserve(&buffer, 1, total_size);
+		fn_buffer_append(&buffer, &header, sizeof(header));
+		fn_buffer_append(&buffer, job.entries, snapshot->num_pages * sizeof(fn_file_page));
+		for (u64 i = 0; i < snapshot->num_pages; i++)
+		{
+			fn_buffer_align(&buffer, 8);
+			fn_buffer_append(&buffer, job.buffers[i].data, job.buffers[i].count);
+		}
+	}
+	else
+	{
+		char version[64];
+		u64 version_size = snprintf(version, sizeof(version), "v %d %d %d\n", VERSION_MAJOR, VERSION_MINOR, VERSION_REVISION);
+
+		total_size = version_size;
+		for (u64 i = 0; i < snapshot->num_pages; i++)
+			total_size += job.buffers[i].count;
+
+		clib_vector_init_reserve(&buffer, 1, total_size);
+		fn_buffer_append(&buffer, version, version_size);
+		for (u64 i = 0; i < snapshot->num_pages; i++)
+			fn_buffer_append(&buffer, job.buffers[i].data, job.buffers[i].count);
+	}
+	CLIB_ASSERT(buffer.count == total_size, "Encoded size doesn't match layout");
+
+	for (u64 i = 0; i < snapshot->num_pages; i++)
+		clib_vector_destroy(&job.buffers[i]);
+	free(job.buffers);
+	free(job.entries);
+
+	*out = buffer;
+}
+
+i32 fn_note_snapshot_write_file(fn_note_snapshot *snapshot, clib_pool *pool, const char *path, fn_file_format format)
+{
+	clib_vector buffer = {0};
+	fn_note_snapshot_encode(snapshot, pool, format, &buffer);
+
+	i32 success = clib_file_write_atomic(path, buffer.data, buffer.count);
+	clib_vector_destroy(&buffer);
+	return success;
+}
+
+static void *fn_saver_thread(void *arg)
+{
+	fn_saver *saver = arg;
+
+	pthread_mutex_lock(&saver->mutex);
+	while (1)
+	{
+		while (!saver->busy && !saver->quit)
+			pthread_cond_wait(&saver->cond, &saver->mutex);
+
+		// Only quit once there's nothing left to write
+		if (!saver->busy) break;
+
+		pthread_mutex_unlock(&saver->mutex);
+		if (!fn_note_snapshot_write_file(&saver->snapshot, saver->pool, saver->path, saver->format))
+			printf("Warning: Failed to save note to %s\n", saver->path);
+
+		// The snapshot isn't needed anymore, give its memory back until the next save
+		clib_arena_reset(saver->mem);
+		clib_arena_shrink(saver->mem);
+		pthread_mutex_lock(&saver->mutex);
+
+		saver->busy = 0;
+		pthread_cond_broadcast(&saver->cond);
+	}
+	pthread_mutex_unlock(&saver->mutex);
+
+	return NULL;
+}
+
+void fn_saver_init(fn_saver *saver, clib_pool *pool)
+{
+	*saver = (fn_saver){0};
+	saver->mem = clib_arena_init_virtual(FN_SAVER_ARENA_SIZE);
+	saver->pool = pool;
+
+	CLIB_ASSERT(pthread_mutex_init(&saver->mutex, NULL) == 0, "Failed to create mutex");
+	CLIB_ASSERT(pthread_cond_init(&saver->cond, NULL) == 0, "Failed to create condition variable");
+	CLIB_ASSERT(pthread_create(&saver->thread, NULL, fn_saver_thread, saver) == 0, "Failed to create saver thread");
+}
+
+void fn_saver_destroy(fn_saver *saver)
+{
+	pthread_mutex_lock(&saver->mutex);
+	saver->quit = 1;
+	pthread_cond_broadcast(&saver->cond);
+	pthread_mutex_unlock(&saver->mutex);
+
+	pthread_join(saver->thread, NULL);
+	pthread_cond_destroy(&saver->cond);
+	pthread_mutex_destroy(&saver->mutex);
+	clib_arena_destroy(&saver->mem);
+
+	*saver = (fn_saver){0};
+}
+
+i32 fn_saver_is_busy(fn_saver *saver)
+{
+	pthread_mutex_lock(&saver->mutex);
+	i32 busy = saver->busy;
+	pthread_mutex_unlock(&saver->mutex);
+	return busy;
+}
+
+void fn_saver_wait(fn_saver *saver)
+{
+	pthread_mutex_lock(&saver->mutex);
+	while (saver->busy)
+		pthread_cond_wait(&saver->cond, &saver->mutex);
+	pthread_mutex_unlock(&saver->mutex);
+}
+
+void fn_saver_release(fn_saver *saver)
+{
+	if (saver->pinned_note == NULL || fn_saver_is_busy(saver)) return;
+
+	fn_note_unpin(saver->pinned_note);
+	saver->pinned_note = NULL;
+}
+
+i32 fn_saver_request(fn_saver *saver, fn_note *note, const char *path, fn_file_format format)
+{
+	if (fn_saver_is_busy(saver)) return 0;
+	fn_saver_release(saver);
+
+	// The worker is idle, so the main thread owns the arena and snapshot until busy is set
+	clib_arena_reset(saver->mem);
+	fn_note_snapshot_take(&saver->snapshot, saver->mem, note);
+	saver->pinned_note = note;
+	snprintf(saver->path, sizeof(saver->path), "%s", path);
+	saver->format = format;
+
+	pthread_mutex_lock(&saver->mutex);
+	saver->busy = 1;
+	pthread_cond_broadcast(&saver->cond);
+	pthread_mutex_unlock(&saver->mutex);
+
+	return 1;
+}
+
+static f64 fn_note_page_extent(fn_note *note, fn_page *page)
+{
+	return page->size.y + note->page_separation;
+}
+
+// Sum of the extents of the first count pages, which is where page count starts
+static f64 fn_note_extents_sum(fn_note *note, u64 count)
+{
+	f64 sum = 0.0;
+	for (u64 i = count; i > 0; i -= i & -i)
+		sum += note->page_extents[i];
+	return sum;
+}
+
+// Linear time, only needed when pages before the last one change
+static void fn_note_extents_build(fn_note *note)
+{
+	for (u64 i = 1; i <= note->num_pages; i++)
+		note->page_extents[i] = fn_note_page_extent(note, note->pages[i - 1]);
+
+	for (u64 i = 1; i <= note->num_pages; i++)
+	{
+		u64 parent = i + (i & -i);
+		if (parent <= note->num_pages)
+			note->page_extents[parent] += note->page_extents[i];
+	}
+}
+
+static void fn_note_reserve_pages(fn_note *note, u64 num_pages)
+{
+	if (num_pages <= note->page_capacity) return;
+
+	u64 capacity = note->page_capacity * 2;
+	if (capacity < 16) capacity = 16;
+	if (capacity < num_pages) capacity = num_pages;
+
+	note->pages = realloc(note->pages, capacity * sizeof(fn_page*));
+	note->page_extents = realloc(note->page_extents, (capacity + 1) * sizeof(f64));
+	CLIB_ASSERT(note->pages && note->page_extents, "realloc failed");
+	note->page_capacity = capacity;
+}
+
+static void fn_note_renumber_pages(fn_note *note, u64 first, u64 last)
+{
+	for (u64 i = first; i <= last && i < note->num_pages; i++)
+		note->pages[i]->page_number = i;
+}
+
+static void fn_note_attach_page(fn_note *note, fn_page *page, u64 page_number)
+{
+	CLIB_ASSERT(page_number <= note->num_pages, "Page number out of range");
+	fn_note_reserve_pages(note, note->num_pages + 1);
+
+	memmove(&note->pages[page_number + 1], &note->pages[page_number], (note->num_pages - page_number) * sizeof(fn_page*));
+	note->pages[page_number] = page;
+	note->num_pages++;
+	fn_note_renumber_pages(note, page_number, note->num_pages - 1);
+
+	if (page_number < note->num_pages - 1)
+	{
+		fn_note_extents_build(note);
+		return;
+	}
+
+	// Appending only has to fill in the new node, from the nodes it covers
+	u64 i = note->num_pages;
+	f64 extent = fn_note_page_extent(note, page);
+	for (u64 j = i - 1; j > i - (i & -i); j -= j & -j)
+		extent += note->page_extents[j];
+	note->page_extents[i] = extent;
+}
+
+// Takes the page out of the note without destroying it
+static void fn_note_detach_page(fn_note *note, u64 page_number)
+{
+	CLIB_ASSERT(page_number < note->num_pages, "Page number out of range");
+
+	memmove(&note->pages[page_number], &note->pages[page_number + 1], (note->num_pages - page_number - 1) * sizeof(fn_page*));
+	note->num_pages--;
+	fn_note_renumber_pages(note, page_number, note->num_pages - 1);
+
+	// Dropping the last page leaves the other nodes as they were
+	if (page_number < note->num_pages)
+		fn_note_extents_build(note);
+}
+
+fn_page *fn_note_insert_page(fn_note *note, u64 page_number)
+{
+	CLIB_ASSERT(page_number <= note->num_pages, "Page number out of range");
+
+	fn_page *page = clib_arena_alloc(note->mem, sizeof(fn_page));
+	fn_page_init(page);
+	page->size = note->page_size;
+	fn_note_attach_page(note, page, page_number);
+
+	return page;
+}
+
+fn_page *fn_note_append_page(fn_note *note)
+{
+	return fn_note_insert_page(note, note->num_pages);
+}
+
+// The page can't be in use by a snapshot
+void fn_note_remove_page(fn_note *note, u64 page_number)
+{
+	CLIB_ASSERT(page_number < note->num_pages, "Page number out of range");
+
+	fn_page *page = note->pages[page_number];
+	CLIB_ASSERT(!page->pinned, "Page is pinned by a snapshot");
+
+	// The history may refer to the page
+	fn_note_history_clear(note);
+
+	fn_note_detach_page(note, page_number);
+	fn_page_destroy(page);
+	clib_arena_free(note->mem, page);
+}
+
+void fn_note_move_page(fn_note *note, u64 from, u64 to)
+{
+	CLIB_ASSERT(from < note->num_pages && to < note->num_pages, "Page number out of range");
+	if (from == to) return;
+
+	fn_page *page = note->pages[from];
+	if (from < to)
+		memmove(&note->pages[from], &note->pages[from + 1], (to - from) * sizeof(fn_page*));
+	else
+		memmove(&note->pages[to + 1], &note->pages[to], (from - to) * sizeof(fn_page*));
+	note->pages[to] = page;
+
+	fn_note_renumber_pages(note, from < to ? from : to, from < to ? to : from);
+	fn_note_extents_build(note);
+}
+
+void fn_note_set_page_size(fn_note *note, u64 page_number, v2 size)
+{
+	CLIB_ASSERT(page_number < note->num_pages, "Page number out of range");
+
+	fn_page *page = note->pages[page_number];
+	f64 delta = (f64)size.y - page->size.y;
+	page->size = size;
+	if (page->mem != NULL && page->grid.cells != NULL)
+		fn_page_grid_rebuild(page);
+
+	for (u64 i = page_number + 1; i <= note->num_pages; i += i & -i)
+		note->page_extents[i] += delta;
+}
+
+v2 fn_note_page_position(fn_note *note, u64 page_number)
+{
+	CLIB_ASSERT(page_number < note->num_pages, "Page number out of range");
+	return (v2){0.0f, (f32)fn_note_extents_sum(note, page_number)};
+}
+
+fn_page *fn_page_at_point(fn_note *note, v2 point)
+{
+	CLIB_ASSERT(note->num_pages > 0, "Note has no pages");
+
+	// Walks down the tree counting the pages that end at or above point,
+	// which is the index of the page it's on
+	u64 index = 0;
+	f64 remaining = point.y;
+	for (u64 step = 1ull << (63 - __builtin_clzll(note->num_pages)); step > 0; step >>= 1)
+	{
+		if (index + step <= note->num_pages && note->page_extents[index + step] <= remaining)
+		{
+			index += step;
+			remaining -= note->page_extents[index];
+		}
+	}
+
+	if (index >= note->num_pages) index = note->num_pages - 1;
+	return note->pages[index];
+}
+
+// Page table entry of version 2 and 3 files
+typedef struct fn_file_page_uniform
+{
+	u64 offset;
+	u64 size;
+	u64 num_strokes;
+	u64 num_points;
+	u32 crc;
+	u32 reserved;
+} fn_file_page_uniform;
+
+_Static_assert (sizeof(fn_file_page_uniform) == 40, "fn_file_page_uniform is not 40 bytes");
+
+// Takes ownership of the mapping on success
+static i32 fn_note_open_binary(fn_note *note, void *mapping, u64 size, const char *path)
+{
+	const fn_file_header *header = mapping;
+	u64 entry_size = header->version > FN_FILE_VERSION_UNIFORM_PAGES ? sizeof(fn_file_page) : sizeof(fn_file_page_uniform);
+	if (header->magic != FN_FILE_MAGIC || header->version < FN_FILE_VERSION_AOS || header->version > FN_FILE_VERSION ||
+			header->num_pages == 0 || header->num_pages > (size - sizeof(fn_file_header)) / entry_size)
+	{
+		printf("Warning: %s is not a binary note\n", path);
+		return 0;
+	}
+
+	// Without a trustworthy page table there's no way to find any of the pages
+	if (clib_crc32c(0, header + 1, header->num_pages * entry_size) != header->table_crc)
+	{
+		printf("Warning: Page table of %s is damaged\n", path);
+		return 0;
+	}
+
+	fn_note_init_empty(note);
+	note->page_size = header->page_size;
+	note->page_separation = header->page_separation;
+	note->mapping = mapping;
+	note->mapping_size = size;
+
+	// Older tables are converted so pages can always point at an fn_file_page, their pages are all the note's size
+	const fn_file_page *table = (const fn_file_page*)(header + 1);
+	if (header->version <= FN_FILE_VERSION_UNIFORM_PAGES)
+	{
+		const fn_file_page_uniform *uniform_table = (const fn_file_page_uniform*)(header + 1);
+		fn_file_page *converted = clib_arena_alloc(note->mem, header->num_pages * sizeof(fn_file_page));
+		for (u64 i = 0; i < header->num_pages; i++)
+		{
+			converted[i] = (fn_file_page){
+				.offset = uniform_table[i].offset,
+				.size = uniform_table[i].size,
+				.num_strokes = uniform_table[i].num_strokes,
+				.num_points = uniform_table[i].num_points,
+				.page_size = header->page_size,
+				.crc = uniform_table[i].crc,
+			};
+		}
+		table = converted;
+	}
+
+	// Only the page table is read here, stroke data stays in the mapping until a page is needed.
+	// Page checksums are verified as each page is materialised.
+	fn_note_reserve_pages(note, header->num_pages);
+	for (u64 i = 0; i < header->num_pages; i++)
+	{
+		const fn_file_page *entry = &table[i];
+		fn_page *page = clib_arena_alloc(note->mem, sizeof(fn_page));
+
+		i32 valid = entry->offset % sizeof(f32) == 0 &&
+			entry->offset <= size && entry->size <= size - entry->offset &&
+			entry->num_points <= entry->size / sizeof(fn_point) &&
+			entry->num_strokes <= entry->size / sizeof(u32) &&
+			entry->size == entry->num_points * sizeof(fn_point) + entry->num_strokes * sizeof(u32);
+
+		if (valid)
+			fn_page_init_mapped(page, entry, (const u8*)mapping + entry->offset, header->version);
+		else
+		{
+			printf("Warning: Page %llu of %s is damaged, leaving it blank\n", i, path);
+			fn_page_init_mapped(page, NULL, NULL, header->version);
+			page->damaged = 1;
+		}
+
+		page->page_number = i;
+		page->size = entry->page_size.x > 0.0f && entry->page_size.y > 0.0f ? entry->page_size : note->page_size;
+		note->pages[i] = page;
+	}
+
+	note->num_pages = header->num_pages;
+	fn_note_extents_build(note);
+	return 1;
+}
+
+// Text notes are small and only used for interchange, so they're parsed into materialised pages up front
+static i32 fn_note_parse_text(fn_note *note, const char *data, u64 size, const char *path)
+{
+	char line[256];
+	u64 line_number = 0;
+
+	fn_page *page = NULL;
+
+	fn_note_init_empty(note);
+
+	u64 index = 0;
+	while (index < size)
+	{
+		const char *end = memchr(data + index, '\n', size - index);
+		u64 line_size = end ? (u64)(end - (data + index)) : size - index;
+		line_number++;
+
+		if (line_size >= sizeof(line))
+		{
+			printf("Warning: Line %llu of %s is too long\n", line_number, path);
+			fn_note_destroy(note);
+			return 0;
+		}
+		memcpy(line, data + index, line_size);
+		line[line_size] = '\0';
+		index += line_size + 1;
+
+		f32 x, y;
+		i32 version_major, version_minor, version_revision;
+
+		if (line_size == 0)
+			continue;
+		else if (line_number == 1)
+		{
+			if (sscanf(line, "v %d %d %d", &version_major, &version_minor, &version_revision) != 3)
+			{
+				printf("Warning: %s is not a note\n", path);
+				fn_note_destroy(note);
+				return 0;
+			}
+		}
+		else if (line[0] == 's')
+		{
+			if (page == NULL)
+				page = fn_note_append_page(note);
+			fn_page_begin_stroke(page);
+		}
+		else if (line[0] == 'p' && sscanf(line, "p %f %f", &x, &y) == 2)
+		{
+			if (page == NULL || page->num_strokes == 0)
+			{
+				printf("Warning: Point outside a stroke on line %llu of %s\n", line_number, path);
+				continue;
+			}
+
+			fn_page_add_point(page, (fn_point){ .pos = (v2){x, y} });
+		}
+		else if (line[0] == 'p')
+			page = fn_note_append_page(note);
+		else if (line[0] == 'd' && sscanf(line, "d %f %f", &x, &y) == 2)
+		{
+			if (page == NULL || !(x > 0.0f && y > 0.0f))
+			{
+				printf("Warning: Skipping page size on line %llu of %s\n", line_number, path);
+				continue;
+			}
+
+			fn_note_set_page_size(note, page->page_number, (v2){x, y});
+		}
+		else
+			printf("Warning: Skipping unknown line %llu of %s\n", line_number, path);
+	}
+
+	if (note->num_pages == 0)
+		fn_note_append_page(note);
+
+	return 1;
+}
+
+i32 fn_note_read_file(fn_note *note, const char *path)
+{
+	i32 fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		printf("Warning: Failed to open file %s\n", path);
+		return 0;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		printf("Warning: %s is not a note\n", path);
+		close(fd);
+		return 0;
+	}
+
+	u64 size = (u64)st.st_size;
+	void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+	{
+		printf("Warning: Failed to map file %s\n", path);
+		return 0;
+	}
+
+	if (size >= sizeof(fn_file_header) && ((const fn_file_header*)mapping)->magic == FN_FILE_MAGIC)
+	{
+		if (fn_note_open_binary(note, mapping, size, path)) return 1;
+		munmap(mapping, size);
+		return 0;
+	}
+
+	i32 success = fn_note_parse_text(note, mapping, size, path);
+	munmap(mapping, size);
+	return success;
+}
+
+void fn_note_init_empty(fn_note *note)
+{
+	*note = (fn_note){0};
+	note->viewport = (v2){-10.0f, -10.0f};
+	note->page_size = V2_A4_SIZE;
+	note->DPI = 100.0f;
+	note->page_separation = 72.0f;
+	note->mem = clib_arena_init(100*1024);
+}
+
+void fn_note_init(fn_note *note)
+{
+	fn_note_init_empty(note);
+	fn_note_append_page(note);
+	fn_note_append_page(note);
+}
+
+// Stays where it is if a snapshot might still be reading it
+static void fn_page_release_columns(fn_page *page, f32 *columns, u64 capacity)
+{
+	if (page->pinned)
+	{
+		fn_retired_columns *retired = (fn_retired_columns*)columns;
+		retired->next = page->retired;
+		retired->size = fn_page_columns_size(capacity);
+		page->retired = retired;
+	}
+	else
+		fn_page_free(page, columns, fn_page_columns_size(capacity));
+}
+
+// Doubles while small so sparse pages stay cheap, then grows by a fixed step
+// so a dense page never copies and holds far more than it needs.
+// Exactly needed when that's more, which is how pages are sized on load.
+static u64 fn_page_next_capacity(u64 capacity, u64 needed, u64 min_capacity, u64 max_growth)
+{
+	u64 next = capacity + (capacity < max_growth ? capacity : max_growth);
+	if (next < min_capacity) next = min_capacity;
+	if (next < needed) next = needed;
+	return next;
+}
+
+// All four columns share one allocation, each capacity floats long.
+// Capacity is rounded up to a multiple of 16 floats, which keeps every column on a cache line.
+static fn_point_columns fn_page_alloc_columns(fn_page *page, u64 *capacity)
+{
+	*capacity = (*capacity + 15) & ~15ull;
+
+	f32 *columns = fn_page_alloc(page, fn_page_columns_size(*capacity), FN_POINT_ALIGNMENT);
+	return (fn_point_columns){
+		.x = columns,
+		.y = columns + *capacity,
+		.t = columns + *capacity * 2,
+		.pressure = columns + *capacity * 3,
+	};
+}
+
+static void fn_page_grow_points(fn_page *page, u64 needed)
+{
+	u64 capacity = fn_page_next_capacity(page->point_capacity, needed, FN_PAGE_MIN_POINTS, FN_PAGE_MAX_POINTS_GROWTH);
+	fn_point_columns points = fn_page_alloc_columns(page, &capacity);
+
+	if (page->point_capacity > 0)
+	{
+		u64 column_size = page->num_points * sizeof(f32);
+		memcpy(points.x, page->points.x, column_size);
+		memcpy(points.y, page->points.y, column_size);
+		memcpy(points.t, page->points.t, column_size);
+		memcpy(points.pressure, page->points.pressure, column_size);
+		fn_page_release_columns(page, page->points.x, page->point_capacity);
+	}
+
+	page->points = points;
+	page->point_capacity = capacity;
+}
+
+// Snapshots copy the strokes, so the old array can always be freed
+static void fn_page_grow_strokes(fn_page *page, u64 needed)
+{
+	u64 capacity = fn_page_next_capacity(page->stroke_capacity, needed, FN_PAGE_MIN_STROKES, FN_PAGE_MAX_STROKES_GROWTH);
+
+	fn_stroke *strokes = fn_page_alloc(page, capacity * sizeof(fn_stroke), CLIB_ARENA_ALIGNMENT);
+	if (page->stroke_capacity > 0)
+	{
+		memcpy(strokes, page->strokes, page->num_strokes * sizeof(fn_stroke));
+		fn_page_free(page, page->strokes, page->stroke_capacity * sizeof(fn_stroke));
+	}
+
+	page->strokes = strokes;
+	page->stroke_capacity = capacity;
+}
+
+void fn_page_reserve(fn_page *page, u64 num_points, u64 num_strokes)
+{
+	CLIB_ASSERT(page->mem, "Page isn't materialised");
+
+	if (page->num_points + num_points > page->point_capacity)
+		fn_page_grow_points(page, page->num_points + num_points);
+	if (page->num_strokes + num_strokes > page->stroke_capacity)
+		fn_page_grow_strokes(page, page->num_strokes + num_strokes);
+}
+
+void fn_page_begin_stroke(fn_page *page)
+{
+	CLIB_ASSERT(page->mem, "Page isn't materialised");
+
+	if (page->num_strokes == page->stroke_capacity)
+		fn_page_grow_strokes(page, 0);
+
+	page->strokes[page->num_strokes] = (fn_stroke){ .first_point = page->num_points };
+	page->num_strokes++;
+}
+
+static const fn_grid_rect fn_grid_rect_empty = {1, 1, 0, 0};
+
+static fn_grid_rect fn_grid_rect_union(fn_grid_rect a, fn_grid_rect b)
+{
+	if (a.min_x > a.max_x) return b;
+	if (b.min_x > b.max_x) return a;
+
+	return (fn_grid_rect){
+		a.min_x < b.min_x ? a.min_x : b.min_x,
+		a.min_y < b.min_y ? a.min_y : b.min_y,
+		a.max_x > b.max_x ? a.max_x : b.max_x,
+		a.max_y > b.max_y ? a.max_y : b.max_y,
+	};
+}
+
+// Clamped to the grid, NaN goes in the first cell
+static u32 fn_grid_cell_coord(f32 v, u32 num_cells)
+{
+	f32 cell = v / FN_GRID_CELL_SIZE;
+	if (!(cell > 0.0f)) return 0;
+	if (cell >= (f32)num_cells) return num_cells - 1;
+	return (u32)cell;
+}
+
+static fn_grid_rect fn_grid_rect_of_point(fn_page_grid *grid, f32 x, f32 y)
+{
+	u32 cx = fn_grid_cell_coord(x, grid->width);
+	u32 cy = fn_grid_cell_coord(y, grid->height);
+	return (fn_grid_rect){cx, cy, cx, cy};
+}
+
+static void fn_grid_push_entry(fn_page *page, u32 cell, fn_grid_hit hit)
+{
+	fn_page_grid *grid = &page->grid;
+
+	if (grid->num_entries == grid->entry_capacity)
+	{
+		u64 capacity = fn_page_next_capacity(grid->entry_capacity, 0, FN_PAGE_MIN_POINTS, FN_PAGE_MAX_POINTS_GROWTH);
+		CLIB_ASSERT(capacity < FN_GRID_NONE, "Too many grid entries");
+
+		fn_grid_entry *entries = fn_page_alloc(page, capacity * sizeof(fn_grid_entry), CLIB_ARENA_ALIGNMENT);
+		if (grid->entry_capacity > 0)
+		{
+			memcpy(entries, grid->entries, grid->num_entries * sizeof(fn_grid_entry));
+			fn_page_free(page, grid->entries, grid->entry_capacity * sizeof(fn_grid_entry));
+		}
+
+		grid->entries = entries;
+		grid->entry_capacity = capacity;
+	}
+
+	grid->entries[grid->num_entries] = (fn_grid_entry){ .hit = hit, .next = grid->cells[cell] };
+	grid->cells[cell] = (u32)grid->num_entries;
+	grid->num_entries++;
+}
+
+// Adds hit to every cell of rect that isn't in skip
+static void fn_grid_add_rect(fn_page *page, fn_grid_hit hit, fn_grid_rect rect, fn_grid_rect skip)
+{
+	for (u32 cy = rect.min_y; cy <= rect.max_y; cy++)
+	{
+		for (u32 cx = rect.min_x; cx <= rect.max_x; cx++)
+		{
+			if (cx >= skip.min_x && cx <= skip.max_x && cy >= skip.min_y && cy <= skip.max_y) continue;
+			fn_grid_push_entry(page, cy * page->grid.width + cx, hit);
+		}
+	}
+}
+
+static u64 fn_stroke_num_chunks(const fn_stroke *stroke)
+{
+	if (stroke->num_points == 0) return 0;
+	return stroke->num_points > 1 ? (stroke->num_points - 2) / FN_GRID_CHUNK_POINTS + 1 : 1;
+}
+
+// Cells of every point in chunk c, the same ones adding the stroke a point at a time reaches
+static fn_grid_rect fn_grid_rect_of_chunk(fn_page *page, const fn_stroke *stroke, u64 c)
+{
+	u64 last_point = stroke->first_point + stroke->num_points - 1;
+	u64 first = stroke->first_point + c * FN_GRID_CHUNK_POINTS;
+	u64 last = first + FN_GRID_CHUNK_POINTS < last_point ? first + FN_GRID_CHUNK_POINTS : last_point;
+
+	fn_grid_rect rect = fn_grid_rect_empty;
+	for (u64 j = first; j <= last; j++)
+		rect = fn_grid_rect_union(rect, fn_grid_rect_of_point(&page->grid, page->points.x[j], page->points.y[j]));
+	return rect;
+}
+
+// Adds every chunk of a whole stroke
+static void fn_page_grid_add_stroke(fn_page *page, u64 stroke_index)
+{
+	fn_page_grid *grid = &page->grid;
+	fn_stroke *stroke = &page->strokes[stroke_index];
+
+	u64 num_chunks = fn_stroke_num_chunks(stroke);
+	for (u64 c = 0; c < num_chunks; c++)
+	{
+		fn_grid_rect rect = fn_grid_rect_of_chunk(page, stroke, c);
+
+		// Whichever chunk comes last stays open, the final stroke may carry on from it
+		grid->open_chunk = (fn_grid_hit){(u32)stroke_index, (u32)c};
+		grid->open_rect = rect;
+		fn_grid_add_rect(page, grid->open_chunk, rect, fn_grid_rect_empty);
+	}
+}
+
+// Takes the strokes from first_stroke on back out of the grid. Strokes are only ever indexed in order,
+// so their entries are the last ones and each is in front of its cell's list.
+static void fn_page_grid_remove_from(fn_page *page, u64 first_stroke)
+{
+	fn_page_grid *grid = &page->grid;
+	if (grid->cells == NULL) return;
+
+	u64 first_entry = grid->num_entries;
+	while (first_entry > 0 && grid->entries[first_entry - 1].hit.stroke >= first_stroke)
+		first_entry--;
+
+	for (u64 i = first_stroke; i < page->num_strokes; i++)
+	{
+		fn_stroke *stroke = &page->strokes[i];
+		u64 num_chunks = fn_stroke_num_chunks(stroke);
+		for (u64 c = 0; c < num_chunks; c++)
+		{
+			fn_grid_rect rect = fn_grid_rect_of_chunk(page, stroke, c);
+			for (u32 cy = rect.min_y; cy <= rect.max_y; cy++)
+			{
+				for (u32 cx = rect.min_x; cx <= rect.max_x; cx++)
+				{
+					u32 *cell = &grid->cells[cy * grid->width + cx];
+					while (*cell != FN_GRID_NONE && *cell >= first_entry)
+						*cell = grid->entries[*cell].next;
+				}
+			}
+		}
+	}
+
+	grid->num_entries = first_entry;
+	if (grid->open_chunk.stroke != FN_GRID_NONE && grid->open_chunk.stroke >= first_stroke)
+	{
+		grid->open_chunk = (fn_grid_hit){FN_GRID_NONE, FN_GRID_NONE};
+		grid->open_rect = fn_grid_rect_empty;
+	}
+}
+
+void fn_page_grid_rebuild(fn_page *page)
+{
+	CLIB_ASSERT(page->mem, "Page isn't materialised");
+	fn_page_grid *grid = &page->grid;
+
+	// The page may have been resized, so the cells are always remade
+	if (grid->cells != NULL)
+		fn_page_free(page, grid->cells, (u64)grid->width * grid->height * sizeof(u32));
+
+	grid->width = (u32)ceilf(page->size.x / FN_GRID_CELL_SIZE);
+	grid->height = (u32)ceilf(page->size.y / FN_GRID_CELL_SIZE);
+	if (grid->width == 0) grid->width = 1;
+	if (grid->height == 0) grid->height = 1;
+
+	u64 num_cells = (u64)grid->width * grid->height;
+	grid->cells = fn_page_alloc(page, num_cells * sizeof(u32), CLIB_ARENA_ALIGNMENT);
+	memset(grid->cells, 0xff, num_cells * sizeof(u32));
+	grid->num_entries = 0;
+	grid->open_chunk = (fn_grid_hit){FN_GRID_NONE, FN_GRID_NONE};
+	grid->open_rect = fn_grid_rect_empty;
+
+	// Hidden strokes stay in, they can be shown again without touching the grid
+	for (u64 i = 0; i < page->num_strokes; i++)
+		fn_page_grid_add_stroke(page, i);
+}
+
+// Called once the point at index j of the final stroke has been added
+static void fn_page_grid_add_point(fn_page *page, u64 j)
+{
+	fn_page_grid *grid = &page->grid;
+	if (grid->cells == NULL)
+	{
+		fn_page_grid_rebuild(page);
+		return;
+	}
+
+	u32 stroke_index = (u32)(page->num_strokes - 1);
+	u64 index = page->strokes[stroke_index].first_point + j;
+	fn_grid_hit hit = {stroke_index, j == 0 ? 0 : (u32)((j - 1) / FN_GRID_CHUNK_POINTS)};
+
+	fn_grid_rect old = fn_grid_rect_empty;
+	fn_grid_rect rect = fn_grid_rect_of_point(grid, page->points.x[index], page->points.y[index]);
+	if (hit.stroke == grid->open_chunk.stroke && hit.chunk == grid->open_chunk.chunk)
+		old = grid->open_rect;
+	else if (j > 0)
+		rect = fn_grid_rect_union(rect, fn_grid_rect_of_point(grid, page->points.x[index - 1], page->points.y[index - 1])); // A new chunk starts at the previous point
+
+	rect = fn_grid_rect_union(rect, old);
+	fn_grid_add_rect(page, hit, rect, old);
+	grid->open_chunk = hit;
+	grid->open_rect = rect;
+}
+
+static int fn_grid_hit_compare(const void *a, const void *b)
+{
+	const fn_grid_hit *hit_a = a;
+	const fn_grid_hit *hit_b = b;
+	if (hit_a->stroke != hit_b->stroke) return hit_a->stroke < hit_b->stroke ? -1 : 1;
+	if (hit_a->chunk != hit_b->chunk) return hit_a->chunk < hit_b->chunk ? -1 : 1;
+	return 0;
+}
+
+static i32 fn_grid_cell_in_radius(u32 cx, u32 cy, v2 centre, f32 radius)
+{
+	f32 min_x = cx * FN_GRID_CELL_SIZE;
+	f32 min_y = cy * FN_GRID_CELL_SIZE;
+	f32 dx = centre.x < min_x ? min_x - centre.x : (centre.x > min_x + FN_GRID_CELL_SIZE ? centre.x - min_x - FN_GRID_CELL_SIZE : 0.0f);
+	f32 dy = centre.y < min_y ? min_y - centre.y : (centre.y > min_y + FN_GRID_CELL_SIZE ? centre.y - min_y - FN_GRID_CELL_SIZE : 0.0f);
+	return dx * dx + dy * dy <= radius * radius;
+}
+
+// Edge cells also hold everything outside the page, so they're never skipped by the radius test
+static u64 fn_page_query_cells(fn_page *page, fn_grid_rect rect, v2 centre, f32 radius, clib_arena *arena, fn_grid_hit **out_hits)
+{
+	*out_hits = NULL;
+	if (page->num_points == 0) return 0;
+	fn_page_grid *grid = &page->grid;
+
+	// Counted first so the hits can go straight into the arena
+	u64 num_hits = 0;
+	fn_grid_hit *hits = NULL;
+	for (i32 pass = 0; pass < 2; pass++)
+	{
+		if (pass == 1)
+		{
+			if (num_hits == 0) return 0;
+			hits = clib_arena_alloc(arena, num_hits * sizeof(fn_grid_hit));
+			num_hits = 0;
+		}
+
+		for (u32 cy = rect.min_y; cy <= rect.max_y; cy++)
+		{
+			for (u32 cx = rect.min_x; cx <= rect.max_x; cx++)
+			{
+				i32 edge = cx == 0 || cy == 0 || cx == grid->width - 1 || cy == grid->height - 1;
+				if (radius >= 0.0f && !edge && !fn_grid_cell_in_radius(cx, cy, centre, radius)) continue;
+
+				for (u32 e = grid->cells[cy * grid->width + cx]; e != FN_GRID_NONE; e = grid->entries[e].next)
+				{
+					if (page->strokes[grid->entries[e].hit.stroke].hidden) continue;
+					if (hits) hits[num_hits] = grid->entries[e].hit;
+					num_hits++;
+				}
+			}
+		}
+	}
+
+	// A chunk is listed in every cell it touches
+	qsort(hits, num_hits, sizeof(fn_grid_hit), fn_grid_hit_compare);
+	u64 num_unique = 1;
+	for (u64 i = 1; i < num_hits; i++)
+	{
+		if (fn_grid_hit_compare(&hits[i], &hits[num_unique - 1]) != 0)
+			hits[num_unique++] = hits[i];
+	}
+
+	*out_hits = hits;
+	return num_unique;
+}
+
+u64 fn_page_query_rect(fn_page *page, v2 min, v2 max, clib_arena *arena, fn_grid_hit **out_hits)
+{
+	fn_page_materialise(page);
+	if (page->grid.cells == NULL) fn_page_grid_rebuild(page);
+
+	fn_grid_rect rect = fn_grid_rect_union(fn_grid_rect_of_point(&page->grid, min.x, min.y), fn_grid_rect_of_point(&page->grid, max.x, max.y));
+	return fn_page_query_cells(page, rect, V2_ZERO, -1.0f, arena, out_hits);
+}
+
+u64 fn_page_query_radius(fn_page *page, v2 centre, f32 radius, clib_arena *arena, fn_grid_hit **out_hits)
+{
+	fn_page_materialise(page);
+	if (page->grid.cells == NULL) fn_page_grid_rebuild(page);
+
+	fn_grid_rect rect = fn_grid_rect_union(
+			fn_grid_rect_of_point(&page->grid, centre.x - radius, centre.y - radius),
+			fn_grid_rect_of_point(&page->grid, centre.x + radius, centre.y + radius));
+	return fn_page_query_cells(page, rect, centre, radius, arena, out_hits);
+}
+
+static void fn_stroke_extend_bounds(fn_stroke *stroke, f32 x, f32 y)
+{
+	if (stroke->num_points == 0)
+	{
+		stroke->bounding_box_pos = (v2){x, y};
+		stroke->bounding_box_size = V2_ZERO;
+		return;
+	}
+
+	v2 min = stroke->bounding_box_pos;
+	v2 max = (v2){min.x + stroke->bounding_box_size.x, min.y + stroke->bounding_box_size.y};
+	if (x < min.x) min.x = x;
+	if (y < min.y) min.y = y;
+	if (x > max.x) max.x = x;
+	if (y > max.y) max.y = y;
+
+	stroke->bounding_box_pos = min;
+	stroke->bounding_box_size = (v2){max.x - min.x, max.y - min.y};
+}
+
+// Leaves the grid alone, for when it's rebuilt afterwards anyway
+static void fn_page_append_point(fn_page *page, fn_point point)
+{
+	CLIB_ASSERT(page->num_strokes > 0, "No stroke to add to");
+
+	if (page->num_points == page->point_capacity)
+		fn_page_grow_points(page, 0);
+
+	u64 index = page->num_points;
+	page->points.x[index] = point.pos.x;
+	page->points.y[index] = point.pos.y;
+	page->points.t[index] = point.t;
+	page->points.pressure[index] = point.pressure;
+	page->num_points++;
+
+	fn_stroke *stroke = &page->strokes[page->num_strokes - 1];
+	fn_stroke_extend_bounds(stroke, point.pos.x, point.pos.y);
+	stroke->num_points++;
+}
+
+void fn_page_add_point(fn_page *page, fn_point point)
+{
+	fn_page_append_point(page, point);
+	fn_page_grid_add_point(page, page->strokes[page->num_strokes - 1].num_points - 1);
+}
+
+static void fn_page_set_hidden(fn_page *page, u64 stroke_index, u32 hidden)
+{
+	fn_stroke *stroke = &page->strokes[stroke_index];
+	if (stroke->hidden == hidden) return;
+
+	stroke->hidden = hidden;
+	if (hidden)
+	{
+		page->num_hidden_strokes++;
+		page->num_hidden_points += stroke->num_points;
+	}
+	else
+	{
+		page->num_hidden_strokes--;
+		page->num_hidden_points -= stroke->num_points;
+	}
+}
+
+static void fn_page_hide_stroke(fn_page *page, u64 stroke_index, clib_vector *hidden)
+{
+	fn_page_set_hidden(page, stroke_index, 1);
+	if (hidden)
+	{
+		u32 index = (u32)stroke_index;
+		clib_vector_push(hidden, &index);
+	}
+}
+
+// Keeps only the strokes with keep set, in order, and remap gets each kept stroke's new index.
+// Everything is copied into new arrays sized for what's left, so the memory of the rest goes back to the page.
+static void fn_page_keep_strokes(fn_page *page, const u8 *keep, u32 *remap)
+{
+	u64 num_strokes = 0;
+	u64 num_points = 0;
+	for (u64 i = 0; i < page->num_strokes; i++)
+	{
+		if (!keep[i]) continue;
+		remap[i] = (u32)num_strokes++;
+		num_points += page->strokes[i].num_points;
+	}
+
+	u64 point_capacity = fn_page_next_capacity(0, num_points, FN_PAGE_MIN_POINTS, FN_PAGE_MAX_POINTS_GROWTH);
+	fn_point_columns points = fn_page_alloc_columns(page, &point_capacity);
+	u64 stroke_capacity = fn_page_next_capacity(0, num_strokes, FN_PAGE_MIN_STROKES, FN_PAGE_MAX_STROKES_GROWTH);
+	fn_stroke *strokes = fn_page_alloc(page, stroke_capacity * sizeof(fn_stroke), CLIB_ARENA_ALIGNMENT);
+
+	u64 first_point = 0;
+	page->num_hidden_strokes = 0;
+	page->num_hidden_points = 0;
+	for (u64 i = 0; i < page->num_strokes; i++)
+	{
+		if (!keep[i]) continue;
+
+		fn_stroke stroke = page->strokes[i];
+		u64 column_size = stroke.num_points * sizeof(f32);
+		memcpy(points.x + first_point, page->points.x + stroke.first_point, column_size);
+		memcpy(points.y + first_point, page->points.y + stroke.first_point, column_size);
+		memcpy(points.t + first_point, page->points.t + stroke.first_point, column_size);
+		memcpy(points.pressure + first_point, page->points.pressure + stroke.first_point, column_size);
+
+		stroke.first_point = first_point;
+		strokes[remap[i]] = stroke;
+		first_point += stroke.num_points;
+
+		if (stroke.hidden)
+		{
+			page->num_hidden_strokes++;
+			page->num_hidden_points += stroke.num_points;
+		}
+	}
+
+	if (page->point_capacity > 0)
+		fn_page_release_columns(page, page->points.x, page->point_capacity);
+	if (page->stroke_capacity > 0)
+		fn_page_free(page, page->strokes, page->stroke_capacity * sizeof(fn_stroke));
+
+	page->points = points;
+	page->num_points = num_points;
+	page->point_capacity = point_capacity;
+	page->strokes = strokes;
+	page->num_strokes = num_strokes;
+	page->stroke_capacity = stroke_capacity;
+
+	fn_page_grid_rebuild(page);
+}
+
+// Cuts out hidden strokes [first, end) and moves the ones after them down, in time for how many points that is
+// rather than the size of the page. Columns are written in place, so the page can't be pinned.
+static void fn_page_drop_strokes(fn_page *page, u64 first, u64 end)
+{
+	CLIB_ASSERT(!page->pinned, "Page is pinned by a snapshot");
+	if (first == end) return;
+
+	fn_page_grid_remove_from(page, first);
+
+	u64 first_point = page->strokes[first].first_point;
+	u64 end_point = end < page->num_strokes ? page->strokes[end].first_point : page->num_points;
+	for (u64 i = first; i < end; i++)
+	{
+		CLIB_ASSERT(page->strokes[i].hidden, "Only hidden strokes can be dropped");
+		page->num_hidden_strokes--;
+		page->num_hidden_points -= page->strokes[i].num_points;
+	}
+
+	u64 num_moved = page->num_strokes - end;
+	u64 column_size = (page->num_points - end_point) * sizeof(f32);
+	memmove(page->points.x + first_point, page->points.x + end_point, column_size);
+	memmove(page->points.y + first_point, page->points.y + end_point, column_size);
+	memmove(page->points.t + first_point, page->points.t + end_point, column_size);
+	memmove(page->points.pressure + first_point, page->points.pressure + end_point, column_size);
+	memmove(page->strokes + first, page->strokes + end, num_moved * sizeof(fn_stroke));
+
+	for (u64 i = first; i < first + num_moved; i++)
+		page->strokes[i].first_point -= end_point - first_point;
+	page->num_strokes -= end - first;
+	page->num_points -= end_point - first_point;
+
+	for (u64 i = first; i < page->num_strokes; i++)
+		fn_page_grid_add_stroke(page, i);
+}
+
+// Squared distance from centre to each line between points [first, first + num_lines]
+static void fn_lines_distance_sq(const fn_point_columns *points, u64 first, u64 num_lines, v2 centre, f32 *out)
+{
+	const f32 *x = points->x + first;
+	const f32 *y = points->y + first;
+	u64 i = 0;
+
+#if defined(__x86_64__)
+	// SSE2 is always there on x86-64, so four lines at a time straight from the columns.
+	// A zero length line has a zero dot product too, so its t comes out as 0 without a branch.
+	__m128 centre_x = _mm_set1_ps(centre.x);
+	__m128 centre_y = _mm_set1_ps(centre.y);
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 tiny = _mm_set1_ps(1e-20f);
+
+	for (; i + 4 <= num_lines; i += 4)
+	{
+		__m128 x0 = _mm_loadu_ps(x + i);
+		__m128 y0 = _mm_loadu_ps(y + i);
+		__m128 dx = _mm_sub_ps(_mm_loadu_ps(x + i + 1), x0);
+		__m128 dy = _mm_sub_ps(_mm_loadu_ps(y + i + 1), y0);
+		__m128 fx = _mm_sub_ps(x0, centre_x);
+		__m128 fy = _mm_sub_ps(y0, centre_y);
+
+		__m128 length_sq = _mm_max_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), tiny);
+		__m128 dot = _mm_add_ps(_mm_mul_ps(fx, dx), _mm_mul_ps(fy, dy));
+		__m128 t = _mm_div_ps(_mm_sub_ps(zero, dot), length_sq);
+		t = _mm_min_ps(_mm_max_ps(t, zero), one);
+
+		__m128 px = _mm_add_ps(fx, _mm_mul_ps(t, dx));
+		__m128 py = _mm_add_ps(fy, _mm_mul_ps(t, dy));
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(px, px), _mm_mul_ps(py, py)));
+	}
+#endif
+
+	for (; i < num_lines; i++)
+	{
+		f32 fx = x[i] - centre.x;
+		f32 fy = y[i] - centre.y;
+		f32 dx = x[i + 1] - x[i];
+		f32 dy = y[i + 1] - y[i];
+		f32 length_sq = dx * dx + dy * dy;
+
+		f32 t = length_sq > 0.0f ? -(fx * dx + fy * dy) / length_sq : 0.0f;
+		t = t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+
+		f32 px = fx + t * dx;
+		f32 py = fy + t * dy;
+		out[i] = px * px + py * py;
+	}
+}
+
+// Squared distances of every line of the stroke, only the lines in hit chunks are measured, the rest are infinitely far.
+// Single point strokes get the distance to their point instead.
+static f32 *fn_stroke_lines_distance_sq(fn_page *page, fn_stroke *stroke, fn_grid_hit *hits, u64 num_hits, v2 centre, clib_arena *scratch)
+{
+	u64 num_lines = stroke->num_points > 1 ? stroke->num_points - 1 : 1;
+	f32 *distances = clib_arena_alloc(scratch, num_lines * sizeof(f32));
+
+	if (stroke->num_points == 1)
+	{
+		f32 dx = page->points.x[stroke->first_point] - centre.x;
+		f32 dy = page->points.y[stroke->first_point] - centre.y;
+		distances[0] = dx * dx + dy * dy;
+		return distances;
+	}
+
+	for (u64 i = 0; i < num_lines; i++)
+		distances[i] = INFINITY;
+
+	for (u64 i = 0; i < num_hits; i++)
+	{
+		u64 first_line = (u64)hits[i].chunk * FN_GRID_CHUNK_POINTS;
+		u64 chunk_lines = num_lines - first_line < FN_GRID_CHUNK_POINTS ? num_lines - first_line : FN_GRID_CHUNK_POINTS;
+		fn_lines_distance_sq(&page->points, stroke->first_point + first_line, chunk_lines, centre, distances + first_line);
+	}
+
+	return distances;
+}
+
+u64 fn_page_erase_strokes(fn_page *page, v2 centre, f32 radius, clib_arena *scratch, clib_vector *hidden)
+{
+	clib_arena_marker marker = clib_arena_mark(scratch);
+
+	fn_grid_hit *hits;
+	u64 num_hits = fn_page_query_radius(page, centre, radius, scratch, &hits);
+	u64 num_erased = 0;
+
+	// Hits are sorted, so each stroke's chunks are next to each other
+	for (u64 i = 0; i < num_hits;)
+	{
+		u64 end = i;
+		while (end < num_hits && hits[end].stroke == hits[i].stroke) end++;
+
+		fn_stroke *stroke = &page->strokes[hits[i].stroke];
+		u64 num_lines = stroke->num_points > 1 ? stroke->num_points - 1 : 1;
+		f32 *distances = fn_stroke_lines_distance_sq(page, stroke, hits + i, end - i, centre, scratch);
+
+		for (u64 j = 0; j < num_lines; j++)
+		{
+			if (distances[j] <= radius * radius)
+			{
+				fn_page_hide_stroke(page, hits[i].stroke, hidden);
+				num_erased++;
+				break;
+			}
+		}
+
+		i = end;
+	}
+
+	clib_arena_restore(&marker);
+	return num_erased;
+}
+
+// Pieces end exactly on the circle, so the precise eraser only cuts what's strictly inside a slightly smaller one.
+// Otherwise rounding puts those ends back inside and holding the eraser still re-cuts them every time.
+static f32 fn_eraser_reach_sq(f32 radius)
+{
+	f32 reach = radius > FN_ERASER_EPSILON ? radius - FN_ERASER_EPSILON : 0.0f;
+	return reach * reach;
+}
+
+static i32 fn_point_in_reach(fn_page *page, u64 index, v2 centre, f32 reach_sq)
+{
+	f32 dx = page->points.x[index] - centre.x;
+	f32 dy = page->points.y[index] - centre.y;
+	return dx * dx + dy * dy < reach_sq;
+}
+
+// Point t of the way along the line from index to index + 1
+static fn_point fn_page_line_point(fn_page *page, u64 index, f32 t)
+{
+	const fn_point_columns *p = &page->points;
+	return (fn_point){
+		.pos = (v2){p->x[index] + (p->x[index + 1] - p->x[index]) * t, p->y[index] + (p->y[index + 1] - p->y[index]) * t},
+		.t = p->t[index] + (p->t[index + 1] - p->t[index]) * t,
+		.pressure = p->pressure[index] + (p->pressure[index + 1] - p->pressure[index]) * t,
+	};
+}
+
+// Where the line from index to index + 1 enters and leaves the circle, as fractions of the line.
+// Only used on lines known to reach the circle, so a miss from rounding counts as touching it.
+static void fn_page_line_crossings(fn_page *page, u64 index, v2 centre, f32 radius, f32 *t_enter, f32 *t_leave)
+{
+	f32 fx = page->points.x[index] - centre.x;
+	f32 fy = page->points.y[index] - centre.y;
+	f32 dx = page->points.x[index + 1] - page->points.x[index];
+	f32 dy = page->points.y[index + 1] - page->points.y[index];
+
+	f32 a = dx * dx + dy * dy;
+	f32 b = 2.0f * (fx * dx + fy * dy);
+	f32 c = fx * fx + fy * fy - radius * radius;
+	if (a <= 0.0f)
+	{
+		*t_enter = 0.0f;
+		*t_leave = 1.0f;
+		return;
+	}
+
+	f32 discriminant = b * b - 4.0f * a * c;
+	f32 root = discriminant > 0.0f ? sqrtf(discriminant) : 0.0f;
+	*t_enter = (-b - root) / (2.0f * a);
+	*t_leave = (-b + root) / (2.0f * a);
+	*t_enter = *t_enter < 0.0f ? 0.0f : (*t_enter > 1.0f ? 1.0f : *t_enter);
+	*t_leave = *t_leave < 0.0f ? 0.0f : (*t_leave > 1.0f ? 1.0f : *t_leave);
+}
+
+// Pieces left with a single point would only be specks
+static void fn_page_end_piece(fn_page *page)
+{
+	fn_stroke *stroke = &page->strokes[page->num_strokes - 1];
+	if (stroke->num_points >= 2) return;
+
+	page->num_points -= stroke->num_points;
+	page->num_strokes--;
+}
+
+// Appends the pieces of the stroke outside the circle, ending each piece where it meets the circle.
+// The page must already have room for them, so the columns being read from stay where they are.
+static void fn_page_append_cut_stroke(fn_page *page, u64 stroke_index, const f32 *distances, v2 centre, f32 radius)
+{
+	fn_stroke stroke = page->strokes[stroke_index];
+	f32 reach_sq = fn_eraser_reach_sq(radius);
+	i32 open = 0;
+
+	for (u64 j = 0; j < stroke.num_points; j++)
+	{
+		u64 i = stroke.first_point + j;
+		i32 inside = fn_point_in_reach(page, i, centre, reach_sq);
+
+		if (!inside)
+		{
+			if (!open) fn_page_begin_stroke(page);
+			open = 1;
+			fn_page_append_point(page, (fn_point){
+				.pos = (v2){page->points.x[i], page->points.y[i]},
+				.t = page->points.t[i],
+				.pressure = page->points.pressure[i],
+			});
+		}
+
+		if (j + 1 == stroke.num_points || !(distances[j] < reach_sq)) continue;
+
+		f32 t_enter, t_leave;
+		fn_page_line_crossings(page, i, centre, radius, &t_enter, &t_leave);
+		if (!inside)
+		{
+			fn_page_append_point(page, fn_page_line_point(page, i, t_enter));
+			fn_page_end_piece(page);
+			open = 0;
+		}
+		if (!fn_point_in_reach(page, i + 1, centre, reach_sq))
+		{
+			fn_page_begin_stroke(page);
+			open = 1;
+			fn_page_append_point(page, fn_page_line_point(page, i, t_leave));
+		}
+	}
+
+	if (open) fn_page_end_piece(page);
+}
+
+u64 fn_page_erase_precise(fn_page *page, v2 centre, f32 radius, clib_arena *scratch, clib_vector *hidden)
+{
+	clib_arena_marker marker = clib_arena_mark(scratch);
+
+	fn_grid_hit *hits;
+	u64 num_hits = fn_page_query_radius(page, centre, radius, scratch, &hits);
+	f32 reach_sq = fn_eraser_reach_sq(radius);
+
+	// Line distances of every stroke the eraser reaches, NULL for the rest
+	f32 **distances = clib_arena_calloc(scratch, (page->num_strokes + 1) * sizeof(f32*));
+	u64 num_cut = 0;
+	u64 num_cut_points = 0;
+	u64 num_crossings = 0;
+
+	for (u64 i = 0; i < num_hits;)
+	{
+		u64 end = i;
+		while (end < num_hits && hits[end].stroke == hits[i].stroke) end++;
+
+		fn_stroke *stroke = &page->strokes[hits[i].stroke];
+		u64 num_lines = stroke->num_points > 1 ? stroke->num_points - 1 : 1;
+		f32 *stroke_distances = fn_stroke_lines_distance_sq(page, stroke, hits + i, end - i, centre, scratch);
+
+		u64 stroke_crossings = 0;
+		for (u64 j = 0; j < num_lines; j++)
+			stroke_crossings += stroke_distances[j] < reach_sq;
+
+		if (stroke_crossings > 0)
+		{
+			distances[hits[i].stroke] = stroke_distances;
+			num_cut++;
+			num_cut_points += stroke->num_points;
+			num_crossings += stroke_crossings;
+		}
+
+		i = end;
+	}
+
+	if (num_cut > 0)
+	{
+		// Every line the eraser reaches can end one piece and start another
+		fn_page_reserve(page, num_cut_points + 2 * num_crossings, num_cut + num_crossings);
+
+		u64 num_strokes = page->num_strokes;
+		for (u64 i = 0; i < num_strokes; i++)
+		{
+			if (distances[i] == NULL) continue;
+
+			u64 first_piece = page->num_strokes;
+			if (page->strokes[i].num_points > 1) // A lone point in reach is just erased
+				fn_page_append_cut_stroke(page, i, distances[i], centre, radius);
+			fn_page_hide_stroke(page, i, hidden);
+
+			for (u64 j = first_piece; j < page->num_strokes; j++)
+				fn_page_grid_add_stroke(page, j);
+		}
+	}
+
+	clib_arena_restore(&marker);
+	return num_cut;
+}
+
+
+// Even-odd test of points [first, first + num_points] against the polygon, inside gets 1 or 0 for each.
+// slopes[j] is dx/dy of the edge from vertex j - 1 to vertex j.
+static void fn_points_in_polygon(const fn_point_columns *points, u64 first, u64 num_points, const v2 *polygon, const f32 *slopes, u64 num_vertices, u8 *inside)
+{
+	const f32 *x = points->x + first;
+	const f32 *y = points->y + first;
+	u64 i = 0;
+
+#if defined(__x86_64__)
+	// Four points against each edge at a time. Horizontal edges have infinite slopes,
+	// but they never pass the straddle test so whatever they compute is masked out.
+	for (; i + 4 <= num_points; i += 4)
+	{
+		__m128 px = _mm_loadu_ps(x + i);
+		__m128 py = _mm_loadu_ps(y + i);
+		__m128 crossings = _mm_setzero_ps();
+
+		for (u64 j = 0, k = num_vertices - 1; j < num_vertices; k = j++)
+		{
+			__m128 above_j = _mm_cmpgt_ps(_mm_set1_ps(polygon[j].y), py);
+			__m128 above_k = _mm_cmpgt_ps(_mm_set1_ps(polygon[k].y), py);
+			__m128 straddles = _mm_xor_ps(above_j, above_k);
+
+			__m128 cross_x = _mm_add_ps(_mm_set1_ps(polygon[j].x), _mm_mul_ps(_mm_sub_ps(py, _mm_set1_ps(polygon[j].y)), _mm_set1_ps(slopes[j])));
+			crossings = _mm_xor_ps(crossings, _mm_and_ps(straddles, _mm_cmplt_ps(px, cross_x)));
+		}
+
+		i32 mask = _mm_movemask_ps(crossings);
+		inside[i] = mask & 1;
+		inside[i + 1] = (mask >> 1) & 1;
+		inside[i + 2] = (mask >> 2) & 1;
+		inside[i + 3] = (mask >> 3) & 1;
+	}
+#endif
+
+	for (; i < num_points; i++)
+	{
+		u8 crossings = 0;
+		for (u64 j = 0, k = num_vertices - 1; j < num_vertices; k = j++)
+		{
+			if ((polygon[j].y > y[i]) != (polygon[k].y > y[i]) &&
+					x[i] < polygon[j].x + (y[i] - polygon[j].y) * slopes[j])
+				crossings ^= 1;
+		}
+		inside[i] = crossings;
+	}
+}
+
+u64 fn_page_select_lasso(fn_page *page, const v2 *polygon, u64 num_vertices, clib_arena *arena, u32 **out_strokes)
+{
+	*out_strokes = NULL;
+	if (num_vertices < 3) return 0;
+
+	v2 min = polygon[0];
+	v2 max = polygon[0];
+	for (u64 i = 1; i < num_vertices; i++)
+	{
+		if (polygon[i].x < min.x) min.x = polygon[i].x;
+		if (polygon[i].y < min.y) min.y = polygon[i].y;
+		if (polygon[i].x > max.x) max.x = polygon[i].x;
+		if (polygon[i].y > max.y) max.y = polygon[i].y;
+	}
+
+	fn_grid_hit *hits;
+	u64 num_hits = fn_page_query_rect(page, min, max, arena, &hits);
+	if (num_hits == 0) return 0;
+
+	f32 *slopes = clib_arena_alloc(arena, num_vertices * sizeof(f32));
+	for (u64 j = 0, k = num_vertices - 1; j < num_vertices; k = j++)
+		slopes[j] = (polygon[k].x - polygon[j].x) / (polygon[k].y - polygon[j].y);
+
+	u32 *strokes = clib_arena_alloc(arena, num_hits * sizeof(u32));
+	u8 *inside = NULL;
+	u64 inside_size = 0;
+	u64 num_selected = 0;
+
+	// Hits are sorted by stroke, only the first of each stroke's hits is needed
+	for (u64 i = 0; i < num_hits; i++)
+	{
+		if (i > 0 && hits[i].stroke == hits[i - 1].stroke) continue;
+		fn_stroke *stroke = &page->strokes[hits[i].stroke];
+
+		// A stroke that pokes out of the polygon's bounds can't be inside it
+		if (stroke->num_points == 0 ||
+				stroke->bounding_box_pos.x < min.x || stroke->bounding_box_pos.y < min.y ||
+				stroke->bounding_box_pos.x + stroke->bounding_box_size.x > max.x ||
+				stroke->bounding_box_pos.y + stroke->bounding_box_size.y > max.y)
+			continue;
+
+		if (stroke->num_points > inside_size)
+		{
+			inside_size = stroke->num_points * 2;
+			inside = clib_arena_alloc(arena, inside_size);
+		}
+		fn_points_in_polygon(&page->points, stroke->first_point, stroke->num_points, polygon, slopes, num_vertices, inside);
+
+		u64 num_inside = 0;
+		for (u64 j = 0; j < stroke->num_points; j++)
+			num_inside += inside[j];
+
+		if (num_inside == stroke->num_points)
+			strokes[num_selected++] = hits[i].stroke;
+	}
+
+	*out_strokes = strokes;
+	return num_selected;
+}
+
+u64 fn_page_transform_strokes(fn_page *page, const u32 *strokes, u64 num_strokes, fn_affine transform, clib_vector *hidden)
+{
+	if (page->grid.cells == NULL) fn_page_grid_rebuild(page);
+
+	u64 num_points = 0;
+	for (u64 i = 0; i < num_strokes; i++)
+		num_points += page->strokes[strokes[i]].num_points;
+	fn_page_reserve(page, num_points, num_strokes);
+
+	// The originals are kept for undo, so the copies go on the end and the columns are only appended to
+	u64 first_copy = page->num_strokes;
+	for (u64 i = 0; i < num_strokes; i++)
+	{
+		fn_stroke stroke = page->strokes[strokes[i]];
+		fn_page_begin_stroke(page);
+
+		for (u64 j = stroke.first_point; j < stroke.first_point + stroke.num_points; j++)
+		{
+			fn_page_append_point(page, (fn_point){
+				.pos = fn_affine_apply(transform, (v2){page->points.x[j], page->points.y[j]}),
+				.t = page->points.t[j],
+				.pressure = page->points.pressure[j],
+			});
+		}
+
+		fn_page_grid_add_stroke(page, page->num_strokes - 1);
+		fn_page_hide_stroke(page, strokes[i], hidden);
+	}
+
+	return first_copy;
+}
+
+fn_affine fn_affine_about(v2 centre, f32 scale, f32 angle, v2 translation)
+{
+	f32 cos_angle = cosf(angle) * scale;
+	f32 sin_angle = sinf(angle) * scale;
+
+	return (fn_affine){
+		.a = cos_angle,
+		.b = sin_angle,
+		.c = -sin_angle,
+		.d = cos_angle,
+		.tx = centre.x - (cos_angle * centre.x - sin_angle * centre.y) + translation.x,
+		.ty = centre.y - (sin_angle * centre.x + cos_angle * centre.y) + translation.y,
+	};
+}
+
+v2 fn_affine_apply(fn_affine transform, v2 point)
+{
+	return (v2){
+		transform.a * point.x + transform.c * point.y + transform.tx,
+		transform.b * point.x + transform.d * point.y + transform.ty,
+	};
+}
+
+i32 fn_affine_is_identity(fn_affine transform)
+{
+	return transform.a == 1.0f && transform.b == 0.0f && transform.c == 0.0f &&
+		transform.d == 1.0f && transform.tx == 0.0f && transform.ty == 0.0f;
+}
+
+void fn_sampler_begin(fn_sampler *sampler)
+{
+	*sampler = (fn_sampler){0};
+}
+
+static void fn_sampler_keep(fn_sampler *sampler, fn_point point)
+{
+	if (sampler->num_kept > 0)
+	{
+		v2 delta = (v2){point.pos.x - sampler->kept.pos.x, point.pos.y - sampler->kept.pos.y};
+		f32 length = sqrtf(delta.x * delta.x + delta.y * delta.y);
+		sampler->direction = (v2){delta.x / length, delta.y / length};
+	}
+
+	sampler->kept = point;
+	sampler->has_seen = 0;
+	sampler->num_kept++;
+}
+
+u32 fn_sampler_add(fn_sampler *sampler, fn_point point, fn_point out[2])
+{
+	if (sampler->num_kept == 0)
+	{
+		fn_sampler_keep(sampler, point);
+		out[0] = point;
+		return 1;
+	}
+
+	v2 delta = (v2){point.pos.x - sampler->kept.pos.x, point.pos.y - sampler->kept.pos.y};
+	f32 distance = sqrtf(delta.x * delta.x + delta.y * delta.y);
+	if (distance < FN_SAMPLE_MIN_DISTANCE)
+		return 0;
+
+	u32 num_out = 0;
+
+	// Turning away from the kept line makes the last point seen a corner, the new point
+	// is then measured from there instead
+	f32 turn_cos = (delta.x * sampler->direction.x + delta.y * sampler->direction.y) / distance;
+	i32 has_direction = sampler->direction.x != 0.0f || sampler->direction.y != 0.0f;
+	if (has_direction && turn_cos < cosf(FN_SAMPLE_MAX_TURN) && sampler->has_seen)
+	{
+		out[num_out++] = sampler->seen;
+		fn_sampler_keep(sampler, sampler->seen);
+
+		delta = (v2){point.pos.x - sampler->kept.pos.x, point.pos.y - sampler->kept.pos.y};
+		distance = sqrtf(delta.x * delta.x + delta.y * delta.y);
+	}
+
+	// The first line of a stroke has nothing to turn from, so it's kept once it's clearly more than jitter
+	if (distance >= FN_SAMPLE_MAX_DISTANCE || (!has_direction && distance >= FN_SAMPLE_MIN_DISTANCE * 4.0f))
+	{
+		out[num_out++] = point;
+		fn_sampler_keep(sampler, point);
+		return num_out;
+	}
+
+	sampler->seen = point;
+	sampler->has_seen = 1;
+	return num_out;
+}
+
+u32 fn_sampler_end(fn_sampler *sampler, fn_point *out)
+{
+	if (!sampler->has_seen) return 0;
+
+	*out = sampler->seen;
+	fn_sampler_keep(sampler, sampler->seen);
+	return 1;
+}
+
+static void fn_note_history_reserve(fn_note *note)
+{
+	fn_history *history = &note->history;
+	if (history->ops.data != NULL) return;
+
+	clib_vector_init(&history->ops, sizeof(fn_op));
+	clib_vector_init(&history->ids, sizeof(u32));
+	clib_vector_init(&history->dropped_pages, sizeof(fn_page*));
+}
+
+// For pages that are out of the note and can't come back
+static void fn_note_drop_page(fn_note *note, fn_page *page)
+{
+	if (note->num_pins > 0)
+	{
+		clib_vector_push(&note->history.dropped_pages, &page);
+		return;
+	}
+
+	fn_page_destroy(page);
+	clib_arena_free(note->mem, page);
+}
+
+// Hidden strokes that no op left in the history can show again are dropped from the page,
+// and the ops' indices into it are moved to match. Nothing else may be holding its stroke indices.
+// It's O(page + history), so it only runs once num_dead_points is big enough to pay for it.
+static void fn_note_compact_page(fn_note *note, fn_page *page)
+{
+	if (page->mem == NULL || page->num_hidden_strokes == 0) return;
+
+	fn_history *history = &note->history;
+	fn_op *ops = history->ops.data;
+	u32 *ids = history->ids.data;
+
+	clib_arena *scratch = clib_thread_scratch();
+	clib_arena_marker marker = clib_arena_mark(scratch);
+	u8 *keep = clib_arena_alloc(scratch, page->num_strokes);
+	u32 *remap = clib_arena_alloc(scratch, page->num_strokes * sizeof(u32));
+
+	for (u64 i = 0; i < page->num_strokes; i++)
+		keep[i] = !page->strokes[i].hidden;
+	for (u64 i = 0; i < history->ops.count; i++)
+	{
+		if (ops[i].type != FN_OP_STROKES || ops[i].page != page) continue;
+		for (u64 j = 0; j < ops[i].num_created; j++)
+			keep[ops[i].first_created + j] = 1;
+		for (u64 j = 0; j < ops[i].num_hidden; j++)
+			keep[ids[ops[i].first_hidden + j]] = 1;
+	}
+
+	u64 num_kept = 0;
+	for (u64 i = 0; i < page->num_strokes; i++)
+		num_kept += keep[i];
+
+	page->num_dead_points = 0;
+	if (num_kept < page->num_strokes)
+	{
+		fn_page_keep_strokes(page, keep, remap);
+
+		// Strokes an op created are all kept, so they stay next to each other
+		for (u64 i = 0; i < history->ops.count; i++)
+		{
+			if (ops[i].type != FN_OP_STROKES || ops[i].page != page) continue;
+			if (ops[i].num_created > 0)
+				ops[i].first_created = remap[ops[i].first_created];
+			for (u64 j = 0; j < ops[i].num_hidden; j++)
+				ids[ops[i].first_hidden + j] = remap[ids[ops[i].first_hidden + j]];
+		}
+	}
+
+	clib_arena_restore(&marker);
+}
+
+// Undone ops can't be redone once something else is done, so they're forgotten before op is added.
+// Its ids may have been pushed after the undone ops' and are moved down to follow the ops that stay.
+// The strokes the undone ops created came after everything the ops before them made, so they're
+// at the end of their pages, save for what op appended after them, and are dropped from there.
+static void fn_note_history_push(fn_note *note, fn_op op)
+{
+	fn_history *history = &note->history;
+	fn_op *ops = history->ops.data;
+	u32 *ids = history->ids.data;
+
+	// Copied out, op takes the place of the first of them
+	clib_arena *scratch = clib_thread_scratch();
+	clib_arena_marker marker = clib_arena_mark(scratch);
+	u64 num_undone = history->ops.count - history->num_done;
+	fn_op *undone = NULL;
+	if (num_undone > 0)
+	{
+		undone = clib_arena_alloc(scratch, num_undone * sizeof(fn_op));
+		memcpy(undone, ops + history->num_done, num_undone * sizeof(fn_op));
+	}
+
+	u32 first_free = 0;
+	if (history->num_done > 0)
+		first_free = ops[history->num_done - 1].first_hidden + ops[history->num_done - 1].num_hidden;
+
+	memmove(ids + first_free, ids + op.first_hidden, op.num_hidden * sizeof(u32));
+	history->ids.count = first_free + op.num_hidden;
+	op.first_hidden = first_free;
+
+	history->ops.count = history->num_done;
+	clib_vector_push(&history->ops, &op);
+	history->num_done++;
+
+	fn_op *pushed = &((fn_op*)history->ops.data)[history->num_done - 1];
+	ids = history->ids.data;
+	for (u64 i = 0; i < num_undone; i++)
+	{
+		fn_page *page = undone[i].page;
+		if (undone[i].type != FN_OP_STROKES || undone[i].num_created == 0) continue;
+
+		// Pages that are out of the note were inserted by an undone op and are about to be dropped
+		if (page->page_number >= note->num_pages || note->pages[page->page_number] != page) continue;
+
+		// A snapshot may still be reading them, so they wait for the page to be compacted
+		if (page->pinned)
+		{
+			for (u64 j = 0; j < undone[i].num_created; j++)
+				page->num_dead_points += page->strokes[undone[i].first_created + j].num_points;
+			continue;
+		}
+
+		// Already dropped along with an earlier undone op's strokes
+		i32 is_pushed_page = pushed->type == FN_OP_STROKES && pushed->page == page;
+		u64 end = is_pushed_page ? pushed->first_created : page->num_strokes;
+		if (undone[i].first_created >= end) continue;
+
+		fn_page_drop_strokes(page, undone[i].first_created, end);
+		if (is_pushed_page)
+		{
+			// The op can hide strokes it created itself
+			u64 num_dropped = end - undone[i].first_created;
+			for (u64 j = 0; j < pushed->num_hidden; j++)
+			{
+				if (ids[pushed->first_hidden + j] >= end)
+					ids[pushed->first_hidden + j] -= (u32)num_dropped;
+			}
+			pushed->first_created = (u32)undone[i].first_created;
+		}
+	}
+
+	for (u64 i = 0; i < num_undone; i++)
+	{
+		if (undone[i].type == FN_OP_INSERT_PAGE)
+			fn_note_drop_page(note, undone[i].page);
+	}
+
+	clib_arena_restore(&marker);
+
+	fn_page *page = pushed->page;
+	if (pushed->type == FN_OP_STROKES && page->num_dead_points >= FN_PAGE_COMPACT_MIN_POINTS &&
+			page->num_dead_points * 2 >= page->num_points)
+		fn_note_compact_page(note, page);
+}
+
+void fn_note_history_begin(fn_note *note, fn_page *page)
+{
+	fn_note_history_reserve(note);
+	fn_history *history = &note->history;
+	CLIB_ASSERT(!history->is_open, "An op is already open");
+
+	fn_page_materialise(page);
+	history->open = (fn_op){
+		.page = page,
+		.type = FN_OP_STROKES,
+		.first_created = (u32)page->num_strokes,
+		.first_hidden = (u32)history->ids.count,
+	};
+	history->is_open = 1;
+}
+
+void fn_note_history_end(fn_note *note)
+{
+	fn_history *history = &note->history;
+	CLIB_ASSERT(history->is_open, "No op is open");
+	history->is_open = 0;
+
+	fn_op op = history->open;
+	op.num_created = (u32)(op.page->num_strokes - op.first_created);
+	op.num_hidden = (u32)(history->ids.count - op.first_hidden);
+	if (op.num_created == 0 && op.num_hidden == 0) return;
+
+	fn_note_history_push(note, op);
+}
+
+void fn_note_history_insert_page(fn_note *note, fn_page *page)
+{
+	fn_note_history_reserve(note);
+	CLIB_ASSERT(!note->history.is_open, "An op is open");
+
+	fn_note_history_push(note, (fn_op){
+		.page = page,
+		.type = FN_OP_INSERT_PAGE,
+		.page_number = (u32)page->page_number,
+		.first_hidden = (u32)note->history.ids.count,
+	});
+}
+
+void fn_note_history_clear(fn_note *note)
+{
+	fn_history *history = &note->history;
+	if (history->ops.data == NULL) return;
+	CLIB_ASSERT(!history->is_open, "An op is open");
+
+	fn_op *ops = history->ops.data;
+	for (u64 i = history->num_done; i < history->ops.count; i++)
+	{
+		if (ops[i].type == FN_OP_INSERT_PAGE)
+			fn_note_drop_page(note, ops[i].page);
+	}
+
+	history->ops.count = 0;
+	history->ids.count = 0;
+	history->num_done = 0;
+
+	// No hidden stroke can be shown again, they're compacted away as their pages are next edited
+	for (u64 i = 0; i < note->num_pages; i++)
+		note->pages[i]->num_dead_points = note->pages[i]->num_hidden_points;
+}
+
+i32 fn_note_undo(fn_note *note)
+{
+	fn_history *history = &note->history;
+	CLIB_ASSERT(!history->is_open, "An op is open");
+	if (history->num_done == 0) return 0;
+
+	history->num_done--;
+	fn_op *op = &((fn_op*)history->ops.data)[history->num_done];
+
+	if (op->type == FN_OP_INSERT_PAGE)
+	{
+		// Pages may have moved since, so it goes back to wherever it is now on redo
+		op->page_number = (u32)op->page->page_number;
+		fn_note_detach_page(note, op->page_number);
+		return 1;
+	}
+
+	// Shown before hiding what was created, so strokes the op made and then hid stay hidden
+	u32 *ids = (u32*)history->ids.data + op->first_hidden;
+	for (u64 i = 0; i < op->num_hidden; i++)
+		fn_page_set_hidden(op->page, ids[i], 0);
+	for (u64 i = 0; i < op->num_created; i++)
+		fn_page_set_hidden(op->page, op->first_created + i, 1);
+
+	return 1;
+}
+
+i32 fn_note_redo(fn_note *note)
+{
+	fn_history *history = &note->history;
+	CLIB_ASSERT(!history->is_open, "An op is open");
+	if (history->num_done == history->ops.count) return 0;
+
+	fn_op *op = &((fn_op*)history->ops.data)[history->num_done];
+	history->num_done++;
+
+	if (op->type == FN_OP_INSERT_PAGE)
+	{
+		fn_note_attach_page(note, op->page, op->page_number < note->num_pages ? op->page_number : note->num_pages);
+		return 1;
+	}
+
+	u32 *ids = (u32*)history->ids.data + op->first_hidden;
+	for (u64 i = 0; i < op->num_created; i++)
+		fn_page_set_hidden(op->page, op->first_created + i, 0);
+	for (u64 i = 0; i < op->num_hidden; i++)
+		fn_page_set_hidden(op->page, ids[i], 1);
+
+	return 1;
+}
+
+static void fn_note_history_destroy(fn_note *note)
+{
+	fn_history *history = &note->history;
+	if (history->ops.data == NULL) return;
+
+	// The page structs themselves go with the note's arena
+	fn_op *ops = history->ops.data;
+	for (u64 i = history->num_done; i < history->ops.count; i++)
+	{
+		if (ops[i].type == FN_OP_INSERT_PAGE)
+			fn_page_destroy(ops[i].page);
+	}
+
+	fn_page **dropped = history->dropped_pages.data;
+	for (u64 i = 0; i < history->dropped_pages.count; i++)
+		fn_page_destroy(dropped[i]);
+
+	clib_vector_destroy(&history->ops);
+	clib_vector_destroy(&history->ids);
+	clib_vector_destroy(&history->dropped_pages);
+}
+
+void fn_page_init(fn_page *page)
+{
+	*page = (fn_page){0};
+	page->mem = clib_arena_init_growing(FN_PAGE_ARENA_MIN_SIZE, FN_PAGE_ARENA_MAX_SIZE);
+}
+
+void fn_page_init_mapped(fn_page *page, const fn_file_page *mapped, const u8 *mapped_data, u32 version)
+{
+	*page = (fn_page){0};
+	page->mapped = mapped;
+	page->mapped_data = mapped_data;
+	page->mapped_version = version;
+}
+
+i32 fn_file_page_verify(const fn_file_page *mapped, const u8 *mapped_data)
+{
+	return clib_crc32c(0, mapped_data, mapped->size) == mapped->crc;
+}
+
+void fn_page_materialise(fn_page *page)
+{
+	if (page->mem != NULL) return;
+
+	page->mem = clib_arena_init_growing(FN_PAGE_ARENA_MIN_SIZE, FN_PAGE_ARENA_MAX_SIZE);
+	if (page->mapped == NULL) return;
+
+	if (!fn_file_page_verify(page->mapped, page->mapped_data))
+	{
+		printf("Warning: Page %llu failed its checksum, leaving it blank\n", page->page_number);
+		page->damaged = 1;
+		page->mapped = NULL;
+		page->mapped_data = NULL;
+		return;
+	}
+
+	const fn_file_page *mapped = page->mapped;
+	if (mapped->num_points > FN_PAGE_MAX_POINTS)
+	{
+		printf("Warning: Page %llu has %llu points, more than the %llu a page can hold, leaving it blank\n",
+			page->page_number, mapped->num_points, FN_PAGE_MAX_POINTS);
+		page->damaged = 1;
+		page->mapped = NULL;
+		page->mapped_data = NULL;
+		return;
+	}
+
+	const u32 *stroke_points = (const u32*)(page->mapped_data + mapped->num_points * sizeof(fn_point));
+
+	// Only points that belong to a stroke are kept
+	u64 num_strokes = 0;
+	u64 num_points = 0;
+	for (; num_strokes < mapped->num_strokes; num_strokes++)
+	{
+		if (stroke_points[num_strokes] > mapped->num_points - num_points)
+		{
+			printf("Warning: Page %llu has more points in its strokes than it stores, dropping the rest\n", page->page_number);
+			break;
+		}
+		num_points += stroke_points[num_strokes];
+	}
+
+	fn_page_reserve(page, num_points, num_strokes);
+
+	if (page->mapped_version == FN_FILE_VERSION_AOS)
+	{
+		const fn_point *points = (const fn_point*)page->mapped_data;
+		for (u64 i = 0; i < num_points; i++)
+		{
+			page->points.x[i] = points[i].pos.x;
+			page->points.y[i] = points[i].pos.y;
+			page->points.t[i] = points[i].t;
+			page->points.pressure[i] = points[i].pressure;
+		}
+	}
+	else if (num_points > 0)
+	{
+		const f32 *columns = (const f32*)page->mapped_data;
+		u64 column_size = num_points * sizeof(f32);
+		memcpy(page->points.x, columns, column_size);
+		memcpy(page->points.y, columns + mapped->num_points, column_size);
+		memcpy(page->points.t, columns + mapped->num_points * 2, column_size);
+		memcpy(page->points.pressure, columns + mapped->num_points * 3, column_size);
+	}
+	page->num_points = num_points;
+
+	u64 first_point = 0;
+	for (u64 i = 0; i < num_strokes; i++)
+	{
+		fn_stroke *stroke = &page->strokes[i];
+		*stroke = (fn_stroke){ .first_point = first_point };
+
+		for (u64 j = first_point; j < first_point + stroke_points[i]; j++)
+		{
+			fn_stroke_extend_bounds(stroke, page->points.x[j], page->points.y[j]);
+			stroke->num_points++;
+		}
+		first_point += stroke_points[i];
+	}
+	page->num_strokes = num_strokes;
+	fn_page_grid_rebuild(page);
+
+	page->mapped = NULL;
+	page->mapped_data = NULL;
+}
+
+void fn_note_get_stats(fn_note *note, fn_note_stats *stats)
+{
+	*stats = (fn_note_stats){0};
+
+	stats->num_pages = note->num_pages;
+	for (u64 i = 0; i < note->num_pages; i++)
+	{
+		fn_page *page = note->pages[i];
+		if (page->damaged) stats->num_damaged_pages++;
+
+		// Mapped pages are counted from the page table without decoding them
+		if (page->mem == NULL)
+		{
+			if (page->mapped)
+			{
+				stats->num_strokes += page->mapped->num_strokes;
+				stats->num_points += page->mapped->num_points;
+			}
+			continue;
+		}
+
+		stats->num_loaded_pages++;
+		stats->page_data_size += page->mem->total_allocation_size + page->large_allocation_size;
+		stats->num_strokes += page->num_strokes - page->num_hidden_strokes;
+		stats->num_points += page->num_points - page->num_hidden_points;
+	}
+}
+
+static void fn_materialise_page_job(void *data, u64 index)
+{
+	fn_page_materialise(((fn_page**)data)[index]);
+}
+
+void fn_note_materialise_all(fn_note *note, clib_pool *pool)
+{
+	// Every page decodes into its own arena, so they can all be decoded at once
+	clib_pool_run(pool, note->num_pages, fn_materialise_page_job, note->pages);
+}
+
+void fn_note_destroy(fn_note *note)
+{
+	fn_note_history_destroy(note);
+	for (u64 i = 0; i < note->num_pages; i++)
+		fn_page_destroy(note->pages[i]);
+	free(note->pages);
+	free(note->page_extents);
+	clib_arena_destroy(&note->mem);
+	if (note->mapping)
+		munmap(note->mapping, note->mapping_size);
+	*note = (fn_note){0};
+}
+
+void fn_page_destroy(fn_page *page)
+{
+	if (page->mem != NULL)
+	{
+		// Only the large allocations live outside the arena
+		fn_page_free_retired(page);
+		if (page->point_capacity > 0)
+			fn_page_free(page, page->points.x, fn_page_columns_size(page->point_capacity));
+		if (page->stroke_capacity > 0)
+			fn_page_free(page, page->strokes, page->stroke_capacity * sizeof(fn_stroke));
+		if (page->grid.entry_capacity > 0)
+			fn_page_free(page, page->grid.entries, page->grid.entry_capacity * sizeof(fn_grid_entry));
+		if (page->grid.cells != NULL)
+			fn_page_free(page, page->grid.cells, (u64)page->grid.width * page->grid.height * sizeof(u32));
+	}
+	clib_arena_destroy(&page->mem);
+	*page = (fn_page){0};
+}
+
+void fn_note_print_info(fn_note *note)
+{
+	u64 total_page_data = 0;
+
+	clib_arena_print_info(note->mem);
+
+	for (u64 i = 0; i < note->num_pages; i++)
+	{
+		fn_page *page = note->pages[i];
+		if (page->damaged)
+			printf("Page %llu is damaged and was left blank\n", page->page_number);
+
+		if (page->mem == NULL)
+		{
+			printf("Page %llu (not loaded)\n", page->page_number);
+			continue;
+		}
+
+		printf("Page %llu\n", page->page_number);
+		clib_arena_print_info(page->mem);
+		if (page->large_allocation_size > 0)
+			printf("Large allocations: %llu bytes\n", page->large_allocation_size);
+		total_page_data += page->mem->total_allocation_size + page->large_allocation_size;
+	}
+	printf("Total page data: %llu bytes\n", total_page_data);
+	printf("Total note data: %llu bytes\n", total_page_data + note->mem->total_allocation_size);
+
+}
+
+#ifdef CLIB_ARENA_TELEMETRY
+void fn_note_write_arena_telemetry(fn_note *note, FILE *file)
+{
+	fprintf(file, "{\"note\": ");
+	clib_arena_telemetry_write_json(note->mem, file);
+	fprintf(file, ",\n\"pages\": [");
+
+	i32 first = 1;
+	for (u64 i = 0; i < note->num_pages; i++)
+	{
+		fn_page *page = note->pages[i];
+		if (page->mem == NULL) continue;
+
+		fprintf(file, "%s\n{\"page\": %llu, \"arena\": ", first ? "" : ",", page->page_number);
+		clib_arena_telemetry_write_json(page->mem, file);
+		fprintf(file, "}");
+		first = 0;
+	}
+	fprintf(file, "\n]}");
+}
+#endif
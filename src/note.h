@@ -0,0 +1,427 @@
+#ifndef _NOTE_H_
+#define _NOTE_H_
+
+#include "clib.h"
+
+#include <pthread.h>
+
+/*
+ * The units for sizes in canvas is POINTS
+ * This is the default unit for a PDF file
+ * 1 point = 1/72 inch
+ * A4 = 595x842 points
+*/
+
+#define VERSION_MAJOR 0
+#define VERSION_MINOR 0
+#define VERSION_REVISION 0
+#define VERSION_STRING "v0.0.0"
+
+#define FN_POINT_ALIGNMENT 64 // Point columns start on a cache line so vectorised kernels can use aligned loads
+#define FN_PAGE_MIN_POINTS 64 // Point columns start with room for this many points and double as they fill up
+#define FN_PAGE_MAX_POINTS_GROWTH (64*1024) // until they grow by this many at a time
+#define FN_PAGE_MIN_STROKES 8
+#define FN_PAGE_MAX_STROKES_GROWTH 4096
+#define FN_GRID_CELL_SIZE 32.0f // Points per side of a spatial index cell
+#define FN_GRID_CHUNK_POINTS 16 // Strokes are indexed in runs of this many lines
+#define FN_GRID_NONE 0xffffffffu
+#define FN_PAGE_ARENA_MIN_SIZE (16*1024) // Page arenas start small so blank pages cost almost nothing
+#define FN_PAGE_ARENA_MAX_SIZE (1024*1024) // and double in size up to this as ink is added
+#define FN_PAGE_LARGE_ALLOCATION (FN_PAGE_ARENA_MAX_SIZE/4) // Page allocations bigger than this are mapped on their own
+#define FN_PAGE_MAX_POINTS (256ull*1024*1024) // Pages with more are left blank when loaded instead of exhausting memory
+#define FN_PAGE_COMPACT_MIN_POINTS 4096 // Pages are compacted once this many of their points, and at least half, are in strokes nothing can show again
+#define FN_ERASER_EPSILON 0.01f // Points the precise eraser leaves on its circle sit this far outside what it cuts next time
+#define FN_SAMPLE_MIN_DISTANCE 0.5f // Input closer than this to the last kept point is jitter
+#define FN_SAMPLE_MAX_DISTANCE 12.0f // Straight lines keep a point this often
+#define FN_SAMPLE_MAX_TURN 0.1f // Radians the pen can turn from the last kept line before the corner is kept
+#define FN_SAVER_ARENA_SIZE (4ull*1024*1024*1024) // Address space reserved for snapshots, only what they use is committed
+
+#define FN_FILE_MAGIC 0x424e4e46 // "FNNB" in a little endian file
+#define FN_FILE_VERSION 4
+#define FN_FILE_VERSION_UNIFORM_PAGES 3 // Older files where every page was the note's size, still readable
+#define FN_FILE_VERSION_AOS 2 // and ones with fn_point structs instead of columns too
+
+#define V2_ZERO ((v2){0.0f, 0.0f})
+#define V2_A4_SIZE ((v2){595.0f, 842.0f})
+#define V2_LETTER_SIZE ((v2){612.0f, 792.0f})
+#define FN_AFFINE_IDENTITY ((fn_affine){1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f})
+
+typedef struct
+{
+	f32 x;
+	f32 y;
+} v2;
+
+typedef struct fn_point
+{
+	v2 pos;
+	f32 t;
+	f32 pressure;
+} fn_point;
+
+// A page's points are stored one array per field, so a scan only touches the fields it needs.
+// Every column is FN_POINT_ALIGNMENT aligned.
+typedef struct fn_point_columns
+{
+	f32 *x;
+	f32 *y;
+	f32 *t;
+	f32 *pressure;
+} fn_point_columns;
+
+// x' = a x + c y + tx, y' = b x + d y + ty
+typedef struct fn_affine
+{
+	f32 a;
+	f32 b;
+	f32 c;
+	f32 d;
+	f32 tx;
+	f32 ty;
+} fn_affine;
+
+// Decides which input points are worth storing. Each one is measured from the last kept point,
+// and the last seen point is kept once the pen turns away or the line gets long.
+typedef struct fn_sampler
+{
+	fn_point kept;
+	fn_point seen; // Not kept yet
+	v2 direction; // Of the line from the point before kept, zero at the start of a stroke
+	i32 num_kept;
+	i32 has_seen;
+} fn_sampler;
+
+// Strokes are contiguous ranges of their page's point columns.
+// Erased and undone strokes are only hidden, so a stroke's index never changes while the note is open.
+typedef struct fn_stroke
+{
+	u64 first_point;
+	u64 num_points;
+	v2 bounding_box_pos;
+	v2 bounding_box_size;
+	u32 hidden; // Not drawn, saved or found by queries
+} fn_stroke;
+
+// Chunk c of a stroke is its points [c * FN_GRID_CHUNK_POINTS, (c + 1) * FN_GRID_CHUNK_POINTS],
+// each one shares its last point with the next so every line between two points is in a chunk
+typedef struct fn_grid_hit
+{
+	u32 stroke;
+	u32 chunk;
+} fn_grid_hit;
+
+// Inclusive range of cells, empty when min_x > max_x
+typedef struct fn_grid_rect
+{
+	u32 min_x;
+	u32 min_y;
+	u32 max_x;
+	u32 max_y;
+} fn_grid_rect;
+
+typedef struct fn_grid_entry
+{
+	fn_grid_hit hit;
+	u32 next; // Next entry in the same cell, FN_GRID_NONE at the end
+} fn_grid_entry;
+
+// Uniform grid over a page, every cell lists the chunks with a point or line inside it.
+// Points outside the page go in the nearest edge cell.
+typedef struct fn_page_grid
+{
+	u32 width; // In cells
+	u32 height;
+	u32 *cells; // First entry of each cell, NULL until the grid is built
+
+	fn_grid_entry *entries;
+	u64 num_entries;
+	u64 entry_capacity;
+
+	// Cells the chunk still being drawn is already in, so new points only add the cells they reach
+	fn_grid_hit open_chunk;
+	fn_grid_rect open_rect;
+} fn_page_grid;
+
+/*
+ * Binary note files (host byte order, only little endian is supported):
+ *
+ * fn_file_header
+ * fn_file_page[num_pages]     page table
+ * page chunks, 8 byte aligned, each one being
+ *     f32[num_points]         x of every point on the page, stroke after stroke
+ *     f32[num_points]         y
+ *     f32[num_points]         t
+ *     f32[num_points]         pressure
+ *     u32[num_strokes]        number of points in each stroke
+ *
+ * Version 3 files had 40 byte page table entries without a page size,
+ * version 2 files also stored fn_point[num_points] instead of the four columns.
+ *
+ * The page table and every page chunk carry a CRC32C, so a damaged page
+ * can be skipped on its own instead of losing the whole note.
+*/
+
+typedef struct fn_file_header
+{
+	u32 magic;
+	u32 version;
+	u64 num_pages;
+	v2 page_size; // For new pages
+	f32 page_separation;
+	u32 table_crc;
+} fn_file_header;
+
+typedef struct fn_file_page
+{
+	u64 offset; // From the start of the file
+	u64 size;
+	u64 num_strokes;
+	u64 num_points;
+	v2 page_size;
+	u32 crc; // Of the page chunk
+	u32 reserved;
+} fn_file_page;
+
+_Static_assert (sizeof(fn_point) == 16, "fn_point is not 16 bytes");
+_Static_assert (sizeof(fn_file_header) == 32, "fn_file_header is not 32 bytes");
+_Static_assert (sizeof(fn_file_page) == 48, "fn_file_page is not 48 bytes");
+
+typedef struct fn_note_stats
+{
+	u64 num_pages;
+	u64 num_loaded_pages;
+	u64 num_damaged_pages;
+	u64 num_strokes;
+	u64 num_points;
+	u64 page_data_size; // Bytes allocated in the arenas of loaded pages
+} fn_note_stats;
+
+typedef enum
+{
+	FN_FILE_TEXT,
+	FN_FILE_BINARY,
+} fn_file_format;
+
+typedef struct fn_page
+{
+	clib_arena *mem; // NULL until the page is materialised
+
+	// Pages opened from a binary file point straight into the mapping
+	// until they are first drawn or edited
+	const fn_file_page *mapped;
+	const u8 *mapped_data;
+	u32 mapped_version;
+	i32 damaged; // Failed validation when loaded, so it was left blank
+
+	u64 page_number; // Index into the note's pages
+	v2 size; // Landscape pages are just wider than they are tall
+
+	fn_point_columns points;
+	u64 num_points;
+	u64 point_capacity;
+
+	fn_stroke *strokes; // Only the final stroke can still be growing
+	u64 num_strokes;
+	u64 stroke_capacity;
+	u64 num_hidden_strokes;
+	u64 num_hidden_points; // In hidden strokes
+	u64 num_dead_points; // In hidden strokes the history can't show again, they go once there are enough of them
+
+	fn_page_grid grid;
+	u64 large_allocation_size; // Bytes mapped outside the arena, see FN_PAGE_LARGE_ALLOCATION
+
+	// While a snapshot shares the point columns, replaced columns are kept instead of freed,
+	// linked together through their first bytes along with their size
+	i32 pinned;
+	void *retired;
+} fn_page;
+
+typedef enum
+{
+	FN_OP_STROKES, // Appended and hid strokes on one page
+	FN_OP_INSERT_PAGE,
+} fn_op_type;
+
+// One undoable change. Strokes are referred to by index rather than copied, so an op is a few bytes
+// plus 4 for each stroke it hid, and undoing or redoing it only touches those strokes.
+typedef struct fn_op
+{
+	fn_page *page;
+	u32 type;
+	u32 page_number; // Where an inserted page goes back to
+	u32 first_created; // Strokes [first_created, first_created + num_created) were appended by the op
+	u32 num_created;
+	u32 first_hidden; // Strokes the op hid are at ids[first_hidden, first_hidden + num_hidden)
+	u32 num_hidden;
+} fn_op;
+
+typedef struct fn_history
+{
+	clib_vector ops; // fn_op
+	clib_vector ids; // u32 stroke indices hidden by the ops, pass it to page functions while an op is open
+	u64 num_done; // ops past this have been undone and can be redone
+
+	fn_op open;
+	i32 is_open;
+
+	// Undone pages that can't come back, destroyed once no snapshot is reading them
+	clib_vector dropped_pages; // fn_page*
+} fn_history;
+
+typedef struct
+{
+	clib_arena *mem;
+
+	// Pages in order, with a Fenwick tree over their extents (height plus separation)
+	// so finding a page's position or the page at a point are both O(log n)
+	fn_page **pages;
+	u64 num_pages;
+	u64 page_capacity;
+	f64 *page_extents; // 1-based Fenwick tree
+
+	// Binary file the note was opened from, kept mapped while any page still points into it
+	void *mapping;
+	u64 mapping_size;
+
+	u64 num_pins; // Snapshots still sharing the pages' point columns
+
+	fn_history history;
+
+	v2 viewport;
+	f32 DPI;
+
+	v2 page_size; // Of new pages
+	f32 page_separation;
+} fn_note;
+
+// Read-only view of a note at the moment a save was requested.
+// Points are only ever appended, so the point columns are shared with the live pages.
+// The pages are pinned so their columns aren't freed until the snapshot is released with fn_note_unpin.
+// The stroke array is copied because the final stroke may still be growing.
+typedef struct fn_page_snapshot
+{
+	u64 page_number;
+	v2 size;
+
+	u64 num_strokes;
+	fn_stroke *strokes; // Hidden strokes are left out
+
+	u64 num_points; // Of the strokes, set gather when they don't cover the columns
+	i32 gather;
+	const f32 *x;
+	const f32 *y;
+	const f32 *t;
+	const f32 *pressure;
+
+	// Set instead when the page was never materialised
+	const fn_file_page *mapped;
+	const u8 *mapped_data;
+} fn_page_snapshot;
+
+typedef struct fn_note_snapshot
+{
+	u64 num_pages;
+	fn_page_snapshot *pages;
+
+	v2 page_size;
+	f32 page_separation;
+} fn_note_snapshot;
+
+// Serialises snapshots on a dedicated I/O thread so saving never blocks rendering
+typedef struct fn_saver
+{
+	clib_arena *mem; // Holds the snapshot, only touched by the main thread while !busy
+	clib_pool *pool; // Shared pool the pages are encoded on
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	fn_note_snapshot snapshot;
+	fn_note *pinned_note; // Unpinned by fn_saver_release once the save is done
+	char path[4096];
+	fn_file_format format;
+
+	i32 busy;
+	i32 quit;
+} fn_saver;
+
+void fn_note_init(fn_note *note);
+void fn_note_init_empty(fn_note *note); // A note without any pages
+void fn_note_destroy(fn_note *note);
+fn_page *fn_note_append_page(fn_note *note); // O(log n)
+fn_page *fn_note_insert_page(fn_note *note, u64 page_number); // Pages after it are renumbered
+void fn_note_remove_page(fn_note *note, u64 page_number); // Clears the undo history
+void fn_note_move_page(fn_note *note, u64 from, u64 to);
+v2 fn_note_page_position(fn_note *note, u64 page_number); // O(log n)
+void fn_note_set_page_size(fn_note *note, u64 page_number, v2 size); // O(log n)
+
+// Everything appended to the page between begin and end, and every stroke index pushed onto
+// note->history.ids in between, becomes one undoable op. Ops that change nothing are dropped.
+// Adding an op after undoing drops the strokes the undone ops created, and pages are compacted once
+// enough of their hidden strokes can't be shown again. Both move the stroke indices of the pages they
+// happen on, but the strokes the op created stay last on its page.
+void fn_note_history_begin(fn_note *note, fn_page *page);
+void fn_note_history_end(fn_note *note);
+void fn_note_history_insert_page(fn_note *note, fn_page *page); // Call after inserting it
+void fn_note_history_clear(fn_note *note);
+i32 fn_note_undo(fn_note *note); // Returns 0 if there's nothing to undo, can't be called while an op is open
+i32 fn_note_redo(fn_note *note);
+
+i32 fn_note_write_file(fn_note *note, clib_arena *scratch, clib_pool *pool, const char *path, fn_file_format format);
+i32 fn_note_read_file(fn_note *note, const char *path); // Binary files are mapped and their pages decoded lazily, text files are parsed up front
+
+void fn_note_materialise_all(fn_note *note, clib_pool *pool); // Decodes every mapped page in parallel on pool
+void fn_note_print_info(fn_note *note);
+void fn_note_get_stats(fn_note *note, fn_note_stats *stats);
+#ifdef CLIB_ARENA_TELEMETRY
+void fn_note_write_arena_telemetry(fn_note *note, FILE *file); // JSON object with the note's arena and every loaded page's
+#endif
+
+void fn_note_snapshot_take(fn_note_snapshot *snapshot, clib_arena *arena, fn_note *note); // Pins the note's pages
+void fn_note_unpin(fn_note *note); // Releases one snapshot's pin, call once it's no longer read
+void fn_note_snapshot_encode(fn_note_snapshot *snapshot, clib_pool *pool, fn_file_format format, clib_vector *out); // Pages are encoded in parallel on pool
+i32 fn_note_snapshot_write_file(fn_note_snapshot *snapshot, clib_pool *pool, const char *path, fn_file_format format);
+
+void fn_saver_init(fn_saver *saver, clib_pool *pool);
+void fn_saver_destroy(fn_saver *saver); // Waits for any in flight save to finish
+i32 fn_saver_is_busy(fn_saver *saver);
+void fn_saver_wait(fn_saver *saver);
+i32 fn_saver_request(fn_saver *saver, fn_note *note, const char *path, fn_file_format format); // Returns 0 if a save is already in flight
+void fn_saver_release(fn_saver *saver); // Unpins the last saved note if the save is done, cheap enough to call every frame
+
+void fn_page_init(fn_page *page);
+void fn_page_init_mapped(fn_page *page, const fn_file_page *mapped, const u8 *mapped_data, u32 version);
+void fn_page_materialise(fn_page *page); // Decodes a mapped page into its arena, does nothing if already materialised
+i32 fn_file_page_verify(const fn_file_page *mapped, const u8 *mapped_data);
+void fn_page_destroy(fn_page *page);
+fn_page *fn_page_at_point(fn_note *note, v2 point); // O(log n), points above or below the note give the first or last page
+
+void fn_page_begin_stroke(fn_page *page);
+void fn_page_add_point(fn_page *page, fn_point point); // Adds to the page's final stroke
+void fn_page_reserve(fn_page *page, u64 num_points, u64 num_strokes); // Makes room for this many more points and strokes
+
+// Spatial queries, in page coordinates. Hits are the unique chunks in cells the area touches,
+// sorted by stroke then chunk, so the caller still tests the points.
+u64 fn_page_query_rect(fn_page *page, v2 min, v2 max, clib_arena *arena, fn_grid_hit **out_hits);
+u64 fn_page_query_radius(fn_page *page, v2 centre, f32 radius, clib_arena *arena, fn_grid_hit **out_hits);
+void fn_page_grid_rebuild(fn_page *page); // Done after loading and resizing, points added later update it as they go
+
+// Erasers, centre is in page coordinates. Strokes are hidden rather than removed and their indices
+// pushed onto hidden (u32) unless it's NULL, cut strokes are replaced by their pieces appended to the page.
+u64 fn_page_erase_strokes(fn_page *page, v2 centre, f32 radius, clib_arena *scratch, clib_vector *hidden); // Hides every stroke within radius, returns how many
+u64 fn_page_erase_precise(fn_page *page, v2 centre, f32 radius, clib_arena *scratch, clib_vector *hidden); // Cuts away everything within radius, returns how many strokes were cut
+
+// Selects the strokes with every point inside the polygon (even-odd rule), in page coordinates
+u64 fn_page_select_lasso(fn_page *page, const v2 *polygon, u64 num_vertices, clib_arena *arena, u32 **out_strokes);
+u64 fn_page_transform_strokes(fn_page *page, const u32 *strokes, u64 num_strokes, fn_affine transform, clib_vector *hidden); // Hides the strokes and appends transformed copies, in order from the index returned
+
+void fn_sampler_begin(fn_sampler *sampler);
+u32 fn_sampler_add(fn_sampler *sampler, fn_point point, fn_point out[2]); // Returns how many points to store from out
+u32 fn_sampler_end(fn_sampler *sampler, fn_point *out); // The stroke ends where the pen left, returns 1 if that still has to be stored
+
+fn_affine fn_affine_about(v2 centre, f32 scale, f32 angle, v2 translation); // Scales and rotates about centre, then translates
+v2 fn_affine_apply(fn_affine transform, v2 point);
+i32 fn_affine_is_identity(fn_affine transform);
+
+#endif // _NOTE_H_